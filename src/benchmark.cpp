@@ -22,12 +22,18 @@
 //// Includes
 ////
 #include <fstream>
+#include <iomanip>
 #include <sstream>
 #include <vector>
 
 #include "benchmark.h"
+#include "history.h"
+#include "mersenne.h"
+#include "movegen.h"
+#include "movepick.h"
 #include "search.h"
 #include "thread.h"
+#include "tt.h"
 #include "ucioption.h"
 
 using namespace std;
@@ -56,6 +62,183 @@ const string BenchmarkPositions[] = {
 };
 
 
+////
+//// Local definitions
+////
+
+namespace {
+
+  // read_positions() fills 'positions' with the fens of the given file, one
+  // per line, or with the default BenchmarkPositions.
+
+  void read_positions(const string& fileName, vector<string>& positions) {
+
+    if (fileName != "default")
+    {
+        ifstream fenFile(fileName.c_str());
+        if (!fenFile.is_open())
+        {
+            cerr << "Unable to open positions file " << fileName << endl;
+            Application::exit_with_failure();
+        }
+        string pos;
+        while (fenFile.good())
+        {
+            getline(fenFile, pos);
+            if (!pos.empty())
+                positions.push_back(pos);
+        }
+        fenFile.close();
+    } else
+        for (int i = 0; i < 16; i++)
+            positions.push_back(string(BenchmarkPositions[i]));
+  }
+
+
+  // search_positions() searches all the positions with the given limits
+  // and returns the total number of nodes. 'smp', if not NULL, receives the
+  // split statistics summed over all the searches.
+
+  int64_t search_positions(const vector<string>& positions, int secsPerPos,
+                           int maxDepth, int maxNodes, SMPInfo* smp) {
+
+    int64_t totalNodes = 0;
+
+    if (smp)
+        *smp = SMPInfo();
+
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        Move moves[1] = {MOVE_NONE};
+        int dummy[2] = {0, 0};
+        Position pos(positions[i]);
+        cerr << "\nBench position: " << i + 1 << '/' << positions.size() << endl << endl;
+        if (!think(pos, true, false, 0, dummy, dummy, 0, maxDepth, maxNodes, secsPerPos, moves))
+            break;
+        totalNodes += nodes_searched();
+
+        if (smp)
+        {
+            SMPInfo info = smp_info();
+            smp->splits += info.splits;
+            smp->splitNanos += info.splitNanos;
+            smp->lateJoins += info.lateJoins;
+            smp->idleNanos += info.idleNanos;
+            smp->wakeups += info.wakeups;
+            smp->wakeNanos += info.wakeNanos;
+            smp->threadBytes = info.threadBytes;
+        }
+    }
+    return totalNodes;
+  }
+
+
+  // pick_moves() walks the tree of the legal moves of 'pos' to the given
+  // depth in plies, and at each node picks up to 'picks' moves with a main
+  // search MovePicker, none if 'picks' is 0. Returns the number of nodes.
+
+  int64_t pick_moves(Position& pos, int depth, int picks, const History& h) {
+
+    MovePicker mp(pos, MOVE_NONE, OnePly, h);
+    for (int i = 0; i < picks && mp.get_next_move() != MOVE_NONE; i++) {}
+
+    if (depth == 0)
+        return 1;
+
+    MoveStack mlist[256];
+    int n = generate_legal_moves(pos, mlist);
+    int64_t nodes = 1;
+
+    for (int i = 0; i < n; i++)
+    {
+        StateInfo st;
+        pos.do_move(mlist[i].move, st);
+        nodes += pick_moves(pos, depth - 1, picks, h);
+        pos.undo_move(mlist[i].move);
+    }
+    return nodes;
+  }
+
+
+  // pick_time() returns the time in nanoseconds to walk the trees of all the
+  // positions with pick_moves(). 'nodes' receives the number of nodes.
+
+  int64_t pick_time(const vector<string>& positions, int picks, int64_t* nodes) {
+
+    static History h;
+    int64_t start = get_system_nanos();
+
+    *nodes = 0;
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        Position pos(positions[i]);
+        *nodes += pick_moves(pos, 3, picks, h);
+    }
+    return get_system_nanos() - start;
+  }
+
+
+  // The TT torture test stores and probes TortureKeys keys, all falling in
+  // the first TortureClusters clusters, so that the threads keep writing
+  // the same entries at the same time.
+  const int TortureKeys = 4096;
+  const int TortureClusters = 64;
+
+  struct TortureThread {
+    const Key* keys;
+    int threadID;
+    int64_t probes, hits, badHits;
+    uint32_t seed;
+  };
+
+  // torture_move() is the move stored with a key. It depends on the key
+  // alone, so that a hit can be checked against the probed key.
+
+  Move torture_move(Key k) {
+
+    return Move(((k >> 48) * 2654435761U) & 0x1FFFF);
+  }
+
+  // torture_thread() is the loop of a thread of the TT torture test. Half
+  // of the iterations store a random key with random data and its own
+  // torture_move(), the others probe a random key and check the move.
+
+#if !defined(_MSC_VER)
+  void* torture_thread(void* t) {
+#else
+  DWORD WINAPI torture_thread(LPVOID t) {
+#endif
+
+    TortureThread* th = (TortureThread*)t;
+    TTEntry tte;
+
+    for (int64_t i = 0; i < th->probes; i++)
+    {
+        th->seed = th->seed * 1664525 + 1013904223;
+        uint32_t r = th->seed >> 8;
+        Key k = th->keys[r % TortureKeys];
+
+        if (r & 0x10000)
+        {
+            ValueType t = ValueType(VALUE_TYPE_UPPER + (r >> 17) % 3);
+            TT.store(k, Value(int((r >> 4) & 0x7FF) - 1024), t, Depth(r & 0x7F), torture_move(k), th->threadID);
+            continue;
+        }
+
+        const TTEntry* e = TT.retrieve(k, &tte, th->threadID);
+        if (e)
+        {
+            th->hits++;
+            if (e->move() != torture_move(k))
+                th->badHits++;
+        }
+    }
+    return 0;
+  }
+
+}
+
+
 ////
 //// Functions
 ////
@@ -77,9 +260,9 @@ void benchmark(const string& commandLine) {
 
   csStr >> ttSize;
   csVal >> val;
-  if (val < 4 || val > 1024)
+  if (val < 4 || val > 262144)
   {
-      cerr << "The hash table size must be between 4 and 1024" << endl;
+      cerr << "The hash table size must be between 4 and 262144" << endl;
       Application::exit_with_failure();
   }
   csStr >> threads;
@@ -109,27 +292,16 @@ void benchmark(const string& commandLine) {
   else
       maxNodes = val;
 
-  vector<string> positions;
-
-  if (fileName != "default")
+  // Without a time limit the search does not need to look at the clock and
+  // the bench becomes reproducible, see "Signature" below.
+  if (!secsPerPos)
   {
-      ifstream fenFile(fileName.c_str());
-      if (!fenFile.is_open())
-      {
-          cerr << "Unable to open positions file " << fileName << endl;
-          Application::exit_with_failure();
-      }
-      string pos;
-      while (fenFile.good())
-      {
-          getline(fenFile, pos);
-          if (!pos.empty())
-              positions.push_back(pos);
-      }
-      fenFile.close();
-  } else
-      for (int i = 0; i < 16; i++)
-          positions.push_back(string(BenchmarkPositions[i]));
+      set_option_value("Deterministic", "true");
+      push_button("Clear Hash");
+  }
+
+  vector<string> positions;
+  read_positions(fileName, positions);
 
   ofstream timingFile;
   if (!timFile.empty())
@@ -142,27 +314,24 @@ void benchmark(const string& commandLine) {
       }
   }
 
-  vector<string>::iterator it;
-  int cnt = 1;
-  int64_t totalNodes = 0;
   int startTime = get_system_time();
-
-  for (it = positions.begin(); it != positions.end(); ++it, ++cnt)
-  {
-      Move moves[1] = {MOVE_NONE};
-      int dummy[2] = {0, 0};
-      Position pos(*it);
-      cerr << "\nBench position: " << cnt << '/' << positions.size() << endl << endl;
-      if (!think(pos, true, false, 0, dummy, dummy, 0, maxDepth, maxNodes, secsPerPos, moves))
-          break;
-      totalNodes += nodes_searched();
-  }
-
-  cnt = get_system_time() - startTime;
+  int64_t totalNodes = search_positions(positions, secsPerPos, maxDepth, maxNodes, NULL);
+  int cnt = get_system_time() - startTime;
   cerr << "==============================="
        << "\nTotal time (ms) : " << cnt
        << "\nNodes searched  : " << totalNodes
-       << "\nNodes/second    : " << (int)(totalNodes/(cnt/1000.0)) << endl << endl;
+       << "\nNodes/second    : " << (int)(totalNodes/(cnt/1000.0))
+       << "\nPrefetch        : " << prefetch_mode()
+       << "\nHash layout     : " << TT.layout() << endl << endl;
+
+  TT.print_stats(cerr, "", true);
+  SMP_STATS_DO(smp_stats(true).print_line(cerr));
+
+  // With one thread a depth or node limited bench searches the same tree on
+  // any machine, the total node count then identifies the search and can be
+  // compared across builds.
+  if (!secsPerPos && threads == "1")
+      cerr << "\nSignature       : " << totalNodes << endl;
 
   if (!timFile.empty())
   {
@@ -177,3 +346,253 @@ void benchmark(const string& commandLine) {
   cin >> fileName;
   #endif
 }
+
+
+/// smp_benchmark() measures the scaling of the parallel search. It searches
+/// the positions to a fixed depth with 1, 2, 4, ... threads up to the given
+/// number, and for each run prints the time to depth, the speedup and the
+/// nodes per second relative to one thread, and what the split points cost:
+/// how many, how long a master takes to set one up, and the search data
+/// allocated per thread, how many split points have been joined late, the
+/// average time from the booking of a slave to the start of its work, and
+/// the percentage of the thread time spent waiting for work. Parameters
+/// are the number of threads, the depth (default 10), the positions file
+/// (default BenchmarkPositions) and optionally a list of UCI options to set
+/// first, like "Late Join=true;Minimum Split Depth=5" or "SMP Mode=Lazy SMP".
+
+void smp_benchmark(const string& commandLine) {
+
+  istringstream cs(commandLine);
+  string fileName, options, option;
+  int maxThreads, depth;
+
+  cs >> maxThreads >> depth >> fileName;
+  getline(cs >> ws, options);
+
+  if (maxThreads < 1 || maxThreads > THREAD_MAX)
+  {
+      cerr << "The number of threads must be between 1 and " << THREAD_MAX << endl;
+      Application::exit_with_failure();
+  }
+
+  vector<string> positions;
+  read_positions(fileName, positions);
+
+  set_option_value("Hash", "32");
+  set_option_value("OwnBook", "false");
+
+  istringstream os(options);
+  while (getline(os, option, ';'))
+  {
+      size_t eq = option.find('=');
+      if (eq != string::npos)
+          set_option_value(option.substr(0, eq), option.substr(eq + 1));
+  }
+
+  ostringstream report;
+  int baseTime = 0, baseNps = 0;
+
+  report << "\nThreads  Time(ms)  Speedup  Nodes        NPS-ratio  Splits    Setup(ns)  KB/thread  Late-joins  Wake(ns)  Idle%\n";
+
+  for (int threads = 1; ; threads = Min(threads * 2, maxThreads))
+  {
+      SMPInfo smp;
+      ostringstream ss;
+
+      ss << threads;
+      set_option_value("Threads", ss.str());
+      push_button("Clear Hash");
+
+      int startTime = get_system_time();
+      int64_t nodes = search_positions(positions, 0, depth, 0, &smp);
+      int time = Max(get_system_time() - startTime, 1);
+      int nps = int(nodes * 1000 / time);
+
+      if (threads == 1)
+      {
+          baseTime = time;
+          baseNps = Max(nps, 1);
+      }
+
+      report << setw(7)  << threads
+             << setw(10) << time
+             << setw(9)  << setprecision(2) << fixed << double(baseTime) / time
+             << "  "     << setw(11) << left << nodes << right
+             << setw(11) << double(nps) / baseNps
+             << setw(8)  << smp.splits
+             << setw(11) << (smp.splits ? smp.splitNanos / smp.splits : 0)
+             << setw(11) << smp.threadBytes / 1024
+             << setw(12) << smp.lateJoins
+             << setw(10) << (smp.wakeups ? smp.wakeNanos / smp.wakeups : 0)
+             << setw(7)  << 100.0 * smp.idleNanos / (1e6 * time * threads) << "\n";
+
+      if (threads == maxThreads)
+          break;
+  }
+
+  cerr << "\n===============================" << report.str() << endl;
+}
+
+
+/// movepick_benchmark() measures the cost of the move ordering. It walks the
+/// legal move trees of the positions to 3 plies and at each node picks the
+/// first move, the first two moves, or all of them with a MovePicker, with
+/// the lists sorted whole when generated and with the lazy ordering, and
+/// prints the time per node once the time of the walk alone is subtracted.
+/// Then it searches the positions to the given depth with each ordering,
+/// and prints the nodes and the nodes per second. Parameters are the depth
+/// (default 8) and the positions file (default BenchmarkPositions).
+
+void movepick_benchmark(const string& commandLine) {
+
+  istringstream cs(commandLine);
+  string fileName;
+  int depth;
+
+  cs >> depth >> fileName;
+
+  vector<string> positions;
+  read_positions(fileName, positions);
+
+  set_option_value("Hash", "32");
+  set_option_value("Threads", "1");
+  set_option_value("OwnBook", "false");
+
+  ostringstream report;
+  const int Picks[] = { 1, 2, 256 };
+  const char* PickNames[] = { "1", "2", "all" };
+  int64_t nodes;
+  int64_t walkTime = pick_time(positions, 0, &nodes);
+
+  report << "\nPicks  Sorted(ns/node)  Lazy(ns/node)\n";
+
+  for (int i = 0; i < 3; i++)
+  {
+      int64_t t[2];
+
+      for (int lazy = 0; lazy < 2; lazy++)
+      {
+          MovePicker::set_lazy_ordering(lazy);
+          t[lazy] = pick_time(positions, Picks[i], &nodes) - walkTime;
+      }
+
+      report << setw(5)  << PickNames[i]
+             << setw(17) << setprecision(1) << fixed << double(t[0]) / nodes
+             << setw(15) << double(t[1]) / nodes << "\n";
+  }
+
+  report << "\nOrdering  Time(ms)  Nodes        NPS\n";
+
+  for (int lazy = 0; lazy < 2; lazy++)
+  {
+      MovePicker::set_lazy_ordering(lazy);
+      push_button("Clear Hash");
+
+      int startTime = get_system_time();
+      nodes = search_positions(positions, 0, depth, 0, NULL);
+      int time = Max(get_system_time() - startTime, 1);
+
+      report << setw(8)  << (lazy ? "lazy" : "sorted")
+             << setw(10) << time
+             << "  "     << setw(11) << left << nodes << right
+             << setw(9)  << nodes * 1000 / time << "\n";
+  }
+
+  MovePicker::set_lazy_ordering(true);
+  cerr << "\n===============================" << report.str() << endl;
+}
+
+
+/// tt_torture_test() checks that the transposition table entries written
+/// and read at the same time by many threads without locking are never
+/// returned torn, see TTEntry. The threads hammer a 4MB table with stores
+/// and probes of a small set of keys sharing a few clusters, each key
+/// always saved with the same move, and a hit returning another move is
+/// counted as inconsistent. Parameters are the number of threads (default
+/// 8) and the millions of iterations per thread (default 4). The test
+/// exits with failure if any inconsistent hit is found.
+
+void tt_torture_test(const string& commandLine) {
+
+  istringstream cs(commandLine);
+  int threads, millions;
+
+  cs >> threads >> millions;
+
+  if (threads < 1 || threads > THREAD_MAX || millions < 1)
+  {
+      cerr << "The number of threads must be between 1 and " << THREAD_MAX
+           << " and the iterations at least 1 million" << endl;
+      Application::exit_with_failure();
+  }
+
+  // With a 4MB table the cluster index is given by the lower 16 bits of
+  // the key. The upper 16 bits are unique, as the compact layout checks
+  // only those, and the bits in between are random.
+  Key keys[TortureKeys];
+  for (int i = 0; i < TortureKeys; i++)
+      keys[i] =  (Key(i + 1) << 48)
+               | (genrand_int64() & 0x0000FFFFFFFF0000ULL)
+               | Key(i % TortureClusters);
+
+  TT.set_size(4);
+  TT.clear();
+  TT.new_search();
+
+  TortureThread* th = new TortureThread[threads];
+#if !defined(_MSC_VER)
+  pthread_t* handles = new pthread_t[threads];
+#else
+  HANDLE* handles = new HANDLE[threads];
+  DWORD iID[1];
+#endif
+
+  int startTime = get_system_time();
+
+  for (int i = 0; i < threads; i++)
+  {
+      th[i].keys = keys;
+      th[i].threadID = i;
+      th[i].probes = int64_t(millions) * 1000000;
+      th[i].hits = th[i].badHits = 0;
+      th[i].seed = genrand_int32();
+
+#if !defined(_MSC_VER)
+      if (pthread_create(&handles[i], NULL, torture_thread, (void*)(&th[i])))
+#else
+      if (!(handles[i] = CreateThread(NULL, 0, torture_thread, (LPVOID)(&th[i]), 0, iID)))
+#endif
+      {
+          cerr << "Failed to launch the torture test threads" << endl;
+          Application::exit_with_failure();
+      }
+  }
+
+  int64_t hits = 0, badHits = 0;
+
+  for (int i = 0; i < threads; i++)
+  {
+#if !defined(_MSC_VER)
+      pthread_join(handles[i], NULL);
+#else
+      WaitForSingleObject(handles[i], INFINITE);
+      CloseHandle(handles[i]);
+#endif
+      hits += th[i].hits;
+      badHits += th[i].badHits;
+  }
+
+  cerr << "==============================="
+       << "\nHash layout     : " << TT.layout()
+       << "\nThreads         : " << threads
+       << "\nIterations      : " << int64_t(millions) * 1000000 * threads
+       << "\nTime (ms)       : " << get_system_time() - startTime
+       << "\nHits            : " << hits
+       << "\nInconsistent    : " << badHits << endl;
+
+  delete [] th;
+  delete [] handles;
+
+  if (badHits)
+      Application::exit_with_failure();
+}
@@ -33,5 +33,8 @@
 ////
 
 extern void benchmark(const std::string& commandLine);
+extern void smp_benchmark(const std::string& commandLine);
+extern void movepick_benchmark(const std::string& commandLine);
+extern void tt_torture_test(const std::string& commandLine);
 
 #endif // !defined(BENCHMARK_H_INCLUDED)
@@ -259,8 +259,9 @@ namespace {
   Value SafetyTable[100];
 
   // Pawn and material hash tables, indexed by the current thread id
-  PawnInfoTable* PawnTable[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-  MaterialInfoTable* MaterialTable[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  PawnInfoTable** PawnTable;
+  MaterialInfoTable** MaterialTable;
+  int TableThreads = 0;
 
   // Sizes of pawn and material hash tables
   const int PawnTableSize = 16384;
@@ -309,13 +310,42 @@ Value evaluate(const Position& pos, EvalInfo& ei, int threadID) {
                         : do_evaluate<false>(pos, ei, threadID);
 }
 
+
+/// bind_eval_tables() moves the pawn and material hash tables of a thread
+/// to the given NUMA node, or releases them with node -1.
+
+void bind_eval_tables(int threadID, int node) {
+
+  assert(threadID >= 0 && threadID < TableThreads);
+
+  if (PawnTable[threadID])
+      PawnTable[threadID]->bind_to_node(node);
+
+  if (MaterialTable[threadID])
+      MaterialTable[threadID]->bind_to_node(node);
+}
+
+
+/// prefetch_eval_tables() preloads in cache the pawn and material hash table
+/// slots of the given position. Called by the search before to probe the
+/// transposition table, so that when evaluate() is reached the slots are
+/// hopefully already in cache.
+
+void prefetch_eval_tables(const Position& pos, int threadID) {
+
+  assert(threadID >= 0 && threadID < TableThreads);
+
+  PawnTable[threadID]->prefetch(pos.get_pawn_key());
+  MaterialTable[threadID]->prefetch(pos.get_material_key());
+}
+
 namespace {
 
 template<bool HasPopCnt>
 Value do_evaluate(const Position& pos, EvalInfo& ei, int threadID) {
 
   assert(pos.is_ok());
-  assert(threadID >= 0 && threadID < THREAD_MAX);
+  assert(threadID >= 0 && threadID < TableThreads);
 
   memset(&ei, 0, sizeof(EvalInfo));
 
@@ -476,23 +506,33 @@ Value quick_evaluate(const Position &pos) {
 
 void init_eval(int threads) {
 
-  assert(threads <= THREAD_MAX);
+  assert(threads >= 1 && threads <= THREAD_MAX);
+
+  // Keep the tables of the threads we still have, so that resizing does
+  // not throw away what has been learned.
+  PawnInfoTable** pt = new PawnInfoTable*[threads];
+  MaterialInfoTable** mt = new MaterialInfoTable*[threads];
 
-  for (int i = 0; i < THREAD_MAX; i++)
+  for (int i = 0; i < Max(threads, TableThreads); i++)
   {
     if (i >= threads)
     {
         delete PawnTable[i];
         delete MaterialTable[i];
-        PawnTable[i] = NULL;
-        MaterialTable[i] = NULL;
         continue;
     }
-    if (!PawnTable[i])
-        PawnTable[i] = new PawnInfoTable(PawnTableSize);
-    if (!MaterialTable[i])
-        MaterialTable[i] = new MaterialInfoTable(MaterialTableSize);
+    pt[i] = (i < TableThreads ? PawnTable[i] : new PawnInfoTable(PawnTableSize));
+    mt[i] = (i < TableThreads ? MaterialTable[i] : new MaterialInfoTable(MaterialTableSize));
+  }
+
+  if (TableThreads)
+  {
+      delete [] PawnTable;
+      delete [] MaterialTable;
   }
+  PawnTable = pt;
+  MaterialTable = mt;
+  TableThreads = threads;
 
   for (Bitboard b = 0ULL; b < 256ULL; b++)
   {
@@ -506,13 +546,17 @@ void init_eval(int threads) {
 
 void quit_eval() {
 
-  for (int i = 0; i < THREAD_MAX; i++)
+  for (int i = 0; i < TableThreads; i++)
   {
       delete PawnTable[i];
       delete MaterialTable[i];
-      PawnTable[i] = NULL;
-      MaterialTable[i] = NULL;
   }
+  if (TableThreads)
+  {
+      delete [] PawnTable;
+      delete [] MaterialTable;
+  }
+  TableThreads = 0;
 }
 
 
@@ -1223,14 +1267,13 @@ namespace {
             SafetyTable[i] = Value((int)(100 * a * (i - b)));
     }
 
-    for (int i = 0; i < 100; i++)
-    {
+    for (int i = 0; i < 99; i++)
         if (SafetyTable[i+1] - SafetyTable[i] > maxSlope)
             for (int j = i + 1; j < 100; j++)
                 SafetyTable[j] = SafetyTable[j-1] + Value(maxSlope);
 
+    for (int i = 0; i < 100; i++)
         if (SafetyTable[i]  > Value(peak))
             SafetyTable[i] = Value(peak);
-    }
   }
 }
@@ -103,6 +103,8 @@ struct EvalInfo {
 
 extern Value evaluate(const Position& pos, EvalInfo& ei, int threadID);
 extern Value quick_evaluate(const Position& pos);
+extern void prefetch_eval_tables(const Position& pos, int threadID);
+extern void bind_eval_tables(int threadID, int node);
 extern void init_eval(int threads);
 extern void quit_eval();
 extern void read_weights(Color sideToMove);
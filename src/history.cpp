@@ -26,6 +26,7 @@
 #include <cstring>
 
 #include "history.h"
+#include "misc.h"
 
 
 ////
@@ -33,9 +34,32 @@
 ////
 
 
-/// Constructor
+/// Constructors, destructor and assignment. The follow-up table is owned
+/// by the object, a copy gets its own.
 
-History::History() { clear(); }
+History::History() : followUp(NULL) { clear(); }
+
+History::History(const History& h) : followUp(NULL) { *this = h; }
+
+History::~History() { use_follow_up(false); }
+
+History& History::operator=(const History& h) {
+
+  if (this == &h)
+      return *this;
+
+  use_follow_up(h.follow_up_in_use());
+
+  memcpy(history, h.history, sizeof(history));
+  memcpy(successCount, h.successCount, sizeof(successCount));
+  memcpy(failureCount, h.failureCount, sizeof(failureCount));
+  memcpy(counterMoves, h.counterMoves, sizeof(counterMoves));
+
+  if (followUp)
+      memcpy(followUp, h.followUp, FollowUpSize * sizeof(int));
+
+  return *this;
+}
 
 
 /// History::clear() clears the history tables
@@ -44,6 +68,31 @@ void History::clear() {
   memset(history, 0, 2 * 8 * 64 * sizeof(int));
   memset(successCount, 0, 2 * 8 * 64 * sizeof(int));
   memset(failureCount, 0, 2 * 8 * 64 * sizeof(int));
+  memset(counterMoves, 0, sizeof(counterMoves));
+  if (followUp)
+      memset(followUp, 0, FollowUpSize * sizeof(int));
+}
+
+
+/// History::use_follow_up() allocates the follow-up table, cleared, or
+/// frees it. Without it no countermove nor follow-up score is kept.
+
+void History::use_follow_up(bool use) {
+
+  if (use == follow_up_in_use())
+      return;
+
+  if (use)
+  {
+      followUp = new int[FollowUpSize];
+      memset(followUp, 0, FollowUpSize * sizeof(int));
+  }
+  else
+  {
+      delete [] followUp;
+      followUp = NULL;
+  }
+  memset(counterMoves, 0, sizeof(counterMoves));
 }
 
 
@@ -103,3 +152,110 @@ bool History::ok_to_prune(Piece p, Square to, Depth d) const {
 
   return (int(d) * successCount[p][to] < failureCount[p][to]);
 }
+
+
+/// History::success_after() registers the success of a non-capturing move
+/// 'm' of piece 'p' to square 'to', played in reply to the previous move.
+/// The move becomes the countermove of the previous one, and its follow-up
+/// history score grows as in success(). The follow-up table must be in use.
+
+void History::success_after(Piece prevP, Square prevTo, Piece p, Square to, Move m, Depth d) {
+
+  assert(follow_up_in_use());
+  assert(piece_is_ok(prevP));
+  assert(piece_is_ok(p));
+  assert(square_is_ok(to));
+  assert(square_is_ok(prevTo));
+
+  int* replies = follow_up(prevP, prevTo);
+  int& score = replies[type_of_piece(p) * 64 + to];
+
+  counterMoves[prevP][prevTo] = m;
+  score += int(d) * int(d);
+
+  // Prevent overflow, scaling down only the replies to the previous move
+  if (score >= HistoryMax)
+      for (int i = 0; i < 8 * 64; i++)
+          replies[i] /= 4;
+}
+
+
+/// History::counter_move() returns the last quiet move which has refuted
+/// the previous move, or MOVE_NONE.
+
+Move History::counter_move(Piece prevP, Square prevTo) const {
+
+  assert(piece_is_ok(prevP));
+
+  return counterMoves[prevP][prevTo];
+}
+
+
+/// History::follow_up_score() returns the follow-up history score of a
+/// non-capturing move as a reply to the previous move, for move ordering.
+/// The follow-up table must be in use.
+
+int History::follow_up_score(Piece prevP, Square prevTo, Piece p, Square to) const {
+
+  assert(follow_up_in_use());
+  assert(piece_is_ok(p));
+  assert(square_is_ok(to));
+
+  return follow_up(prevP, prevTo)[type_of_piece(p) * 64 + to];
+}
+
+
+/// History::merge() adds to this table what another one has learnt since
+/// both were equal to 'base', used to combine the tables of the threads
+/// when each has its own. Scores that the other table has scaled down in
+/// the meantime give a negative difference, the sum is then kept at zero
+/// at least. The scores are scaled down like in success() if they grow too
+/// big, the counts are never scaled, as in a single table.
+
+void History::merge(const History& h, const History& base) {
+
+  int maxScore = 0;
+
+  for (int i = 0; i < 16; i++)
+      for (int j = 0; j < 64; j++)
+      {
+          history[i][j] = Max(history[i][j] + h.history[i][j] - base.history[i][j], 0);
+          successCount[i][j] += h.successCount[i][j] - base.successCount[i][j];
+          failureCount[i][j] += h.failureCount[i][j] - base.failureCount[i][j];
+          if (history[i][j] > maxScore)
+              maxScore = history[i][j];
+      }
+
+  while (maxScore >= HistoryMax)
+  {
+      for (int i = 0; i < 16; i++)
+          for (int j = 0; j < 64; j++)
+              history[i][j] /= 4;
+
+      maxScore /= 4;
+  }
+
+  // A countermove set by the other table only replaces one we have not
+  // changed. The follow-up scores are merged like the history scores.
+  for (int i = 0; i < 16; i++)
+      for (int j = 0; j < 64; j++)
+          if (   counterMoves[i][j] == base.counterMoves[i][j]
+              && h.counterMoves[i][j] != base.counterMoves[i][j])
+              counterMoves[i][j] = h.counterMoves[i][j];
+
+  if (!followUp || !h.followUp || !base.followUp)
+      return;
+
+  maxScore = 0;
+
+  for (int i = 0; i < FollowUpSize; i++)
+  {
+      followUp[i] = Max(followUp[i] + h.followUp[i] - base.followUp[i], 0);
+      if (followUp[i] > maxScore)
+          maxScore = followUp[i];
+  }
+
+  for ( ; maxScore >= HistoryMax; maxScore /= 4)
+      for (int i = 0; i < FollowUpSize; i++)
+          followUp[i] /= 4;
+}
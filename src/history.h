@@ -25,6 +25,8 @@
 //// Includes
 ////
 
+#include <cstddef>
+
 #include "depth.h"
 #include "move.h"
 #include "piece.h"
@@ -40,24 +42,66 @@
 /// entries are stored according only to moving piece and destination square,
 /// in particular two moves with different origin but same destination and
 /// same piece will be considered identical.
+///
+/// With "Countermove History" the class also stores, for the last move of
+/// the opponent, the quiet move which has last refuted it (the
+/// "countermove"), and a follow-up history of the successes of each move as
+/// a reply to it. The previous move is given by the piece it has moved and
+/// its destination square. The follow-up table takes 2 MB, so it is
+/// allocated only when in use, see use_follow_up().
 
 class History {
 
 public:
   History();
+  History(const History& h);
+  ~History();
+  History& operator=(const History& h);
   void clear();
   void success(Piece p, Square to, Depth d);
   void failure(Piece p, Square to);
   int move_ordering_score(Piece p, Square to) const;
   bool ok_to_prune(Piece p, Square to, Depth d) const;
+  void merge(const History& h, const History& base);
+
+  void use_follow_up(bool use);
+  bool follow_up_in_use() const;
+  void success_after(Piece prevP, Square prevTo, Piece p, Square to, Move m, Depth d);
+  Move counter_move(Piece prevP, Square prevTo) const;
+  int follow_up_score(Piece prevP, Square prevTo, Piece p, Square to) const;
 
 private:
+  // The reply is by the other side, so its piece type is enough
+  static const int FollowUpSize = 16 * 64 * 8 * 64;
+  int* follow_up(Piece prevP, Square prevTo) const;
+
   int history[16][64];  // [piece][square]
   int successCount[16][64];
   int failureCount[16][64];
+  Move counterMoves[16][64]; // [previous piece][previous square]
+  int* followUp;             // [previous ...][piece type][square], or NULL
 };
 
 
+////
+//// Inline functions
+////
+
+/// History::follow_up_in_use() tells whether the countermoves and the
+/// follow-up history are kept, see use_follow_up().
+
+inline bool History::follow_up_in_use() const {
+  return followUp != NULL;
+}
+
+/// History::follow_up() returns the follow-up scores of the replies to the
+/// previous move, indexed by [piece type][square].
+
+inline int* History::follow_up(Piece prevP, Square prevTo) const {
+  return followUp + (int(prevP) * 64 + int(prevTo)) * 8 * 64;
+}
+
+
 ////
 //// Constants and variables
 ////
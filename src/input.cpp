@@ -0,0 +1,196 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2009 Marco Costalba
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+////
+//// Includes
+////
+
+#include <iostream>
+
+#if !defined(_MSC_VER)
+#  include <pthread.h>
+#  include <unistd.h>
+#else
+#  include <windows.h>
+#endif
+
+#include "input.h"
+#include "lock.h"
+
+
+////
+//// Variables
+////
+
+/// InputPending is set by the reader thread each time it queues a line, so
+/// that the search can react at its next node, see init_node(). The main
+/// thread clears it before to empty the queue.
+
+volatile bool InputPending = false;
+
+
+////
+//// Local definitions
+////
+
+namespace {
+
+  // The lines read from the standard input, in a ring written by the reader
+  // thread and read by the main thread only. Each side moves its own index,
+  // a line is published by a memory barrier before the write of Head, so the
+  // queue needs no lock. The lock and the condition below are used only to
+  // sleep in read_input() when the queue is empty.
+
+  const int QueueSize = 256;
+
+  std::string Queue[QueueSize];
+  volatile int Head; // Next slot written by the reader thread
+  volatile int Tail; // Next slot read by the main thread
+  bool Started;
+
+#if !defined(_MSC_VER)
+  pthread_mutex_t WaitLock;
+  pthread_cond_t WaitCond;
+#else
+  HANDLE WaitEvent;
+#endif
+
+  // Local functions
+#if !defined(_MSC_VER)
+  void* reader_thread(void*);
+#else
+  DWORD WINAPI reader_thread(LPVOID);
+#endif
+}
+
+
+////
+//// Functions
+////
+
+/// start_input_thread() launches the thread that reads the standard input.
+/// It is called once by the UCI main loop, the benchmarks do not read the
+/// input while searching.
+
+void start_input_thread() {
+
+  if (Started)
+      return;
+
+  Started = true;
+
+#if !defined(_MSC_VER)
+  pthread_t pthread;
+  pthread_mutex_init(&WaitLock, NULL);
+  pthread_cond_init(&WaitCond, NULL);
+  pthread_create(&pthread, NULL, reader_thread, NULL);
+  pthread_detach(pthread);
+#else
+  DWORD iID;
+  WaitEvent = CreateEvent(0, FALSE, FALSE, 0);
+  CloseHandle(CreateThread(NULL, 0, reader_thread, NULL, 0, &iID));
+#endif
+}
+
+
+/// input_available() tells whether a line is waiting in the queue. It does
+/// not block nor call the system, it is cheap enough to be polled during
+/// the search.
+
+bool input_available() {
+
+  return Tail != Head;
+}
+
+
+/// read_input() removes the oldest line from the queue and returns it,
+/// waiting for one if the queue is empty. When the standard input is closed
+/// the reader thread queues a "quit" command, so that the engine exits.
+
+std::string read_input() {
+
+  if (!input_available())
+  {
+#if !defined(_MSC_VER)
+      pthread_mutex_lock(&WaitLock);
+      while (!input_available())
+          pthread_cond_wait(&WaitCond, &WaitLock);
+      pthread_mutex_unlock(&WaitLock);
+#else
+      while (!input_available())
+          WaitForSingleObject(WaitEvent, INFINITE);
+#endif
+  }
+
+  memory_barrier();
+  std::string line = Queue[Tail % QueueSize];
+  memory_barrier();
+  Tail = Tail + 1;
+  return line;
+}
+
+
+////
+//// Local functions
+////
+
+namespace {
+
+  // reader_thread() is the function of the thread reading the standard input.
+  // It blocks on getline() and queues each line, waiting if the queue is full.
+  // It stops after "quit" or at the end of the input.
+
+#if !defined(_MSC_VER)
+  void* reader_thread(void*) {
+#else
+  DWORD WINAPI reader_thread(LPVOID) {
+#endif
+
+    std::string line;
+
+    do {
+        if (!std::getline(std::cin, line))
+            line = "quit";
+
+        while (Head - Tail >= QueueSize)
+#if !defined(_MSC_VER)
+            usleep(1000);
+#else
+            Sleep(1);
+#endif
+
+        Queue[Head % QueueSize] = line;
+        memory_barrier();
+        Head = Head + 1;
+        InputPending = true;
+
+#if !defined(_MSC_VER)
+        pthread_mutex_lock(&WaitLock);
+        pthread_cond_signal(&WaitCond);
+        pthread_mutex_unlock(&WaitLock);
+#else
+        SetEvent(WaitEvent);
+#endif
+
+    } while (line != "quit");
+
+    return 0;
+  }
+}
@@ -99,4 +99,51 @@ typedef CRITICAL_SECTION Lock;
 #endif
 
 
+// Atomic operations on an int, for the few shared variables which are
+// updated too often to take a lock each time, and a full memory barrier
+// to publish data to another thread without a lock.
+
+#include "types.h"
+
+#if !defined(_MSC_VER)
+
+inline int atomic_fetch_add_int(volatile int* x, int v) {
+  return __sync_fetch_and_add(x, v);
+}
+
+inline int64_t atomic_fetch_add_int64(volatile int64_t* x, int64_t v) {
+  return __sync_fetch_and_add(x, v);
+}
+
+inline bool atomic_cas_int(volatile int* x, int oldValue, int newValue) {
+  return __sync_bool_compare_and_swap(x, oldValue, newValue);
+}
+
+inline void memory_barrier() {
+  __sync_synchronize();
+}
+
+#else
+
+#include <windows.h>
+
+inline int atomic_fetch_add_int(volatile int* x, int v) {
+  return InterlockedExchangeAdd((volatile long*)x, v);
+}
+
+inline int64_t atomic_fetch_add_int64(volatile int64_t* x, int64_t v) {
+  return InterlockedExchangeAdd64((volatile LONGLONG*)x, v);
+}
+
+inline bool atomic_cas_int(volatile int* x, int oldValue, int newValue) {
+  return InterlockedCompareExchange((volatile long*)x, newValue, oldValue) == oldValue;
+}
+
+inline void memory_barrier() {
+  MemoryBarrier();
+}
+
+#endif
+
+
 #endif // !defined(LOCK_H_INCLUDED)
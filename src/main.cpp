@@ -58,6 +58,50 @@ int main(int argc, char *argv[]) {
 #endif
 
   // Process command line arguments if any
+  if (argc > 1 && string(argv[1]) == "smpbench")
+  {
+      if (argc < 3 || argc > 6)
+          cout << "Usage: stockfish smpbench <threads> "
+               << "[depth = 10] [fen positions file = default] "
+               << "[\"option=value;option=value...\" = none]" << endl;
+      else
+      {
+          string depth = argc > 3 ? argv[3] : "10";
+          string fen = argc > 4 ? argv[4] : "default";
+          string opt = argc > 5 ? argv[5] : "";
+          smp_benchmark(string(argv[2]) + " " + depth + " " + fen + " " + opt);
+      }
+      return 0;
+  }
+
+  if (argc > 1 && string(argv[1]) == "movepickbench")
+  {
+      if (argc > 4)
+          cout << "Usage: stockfish movepickbench "
+               << "[depth = 8] [fen positions file = default]" << endl;
+      else
+      {
+          string depth = argc > 2 ? argv[2] : "8";
+          string fen = argc > 3 ? argv[3] : "default";
+          movepick_benchmark(depth + " " + fen);
+      }
+      return 0;
+  }
+
+  if (argc > 1 && string(argv[1]) == "tttorture")
+  {
+      if (argc > 4)
+          cout << "Usage: stockfish tttorture "
+               << "[threads = 8] [millions of iterations per thread = 4]" << endl;
+      else
+      {
+          string threads = argc > 2 ? argv[2] : "8";
+          string millions = argc > 3 ? argv[3] : "4";
+          tt_torture_test(threads + " " + millions);
+      }
+      return 0;
+  }
+
   if (argc > 1)
   {
       if (string(argv[1]) != "bench" || argc < 4 || argc > 8)
@@ -23,8 +23,9 @@
 ////
 
 #include <cassert>
-#include <sstream>
 #include <map>
+#include <new>
+#include <sstream>
 
 #include "material.h"
 
@@ -85,7 +86,9 @@ private:
 MaterialInfoTable::MaterialInfoTable(unsigned int numOfEntries) {
 
   size = numOfEntries;
-  entries = new MaterialInfo[size];
+
+  // Page aligned, so that the table can be moved to the node of its thread
+  entries = (MaterialInfo*)page_alloc(size * sizeof(MaterialInfo));
   funcs = new EndgameFunctions();
   if (!entries || !funcs)
   {
@@ -93,6 +96,8 @@ MaterialInfoTable::MaterialInfoTable(unsigned int numOfEntries) {
                 << " bytes for material hash table." << std::endl;
       Application::exit_with_failure();
   }
+  for (unsigned i = 0; i < size; i++)
+      new (entries + i) MaterialInfo();
 }
 
 
@@ -101,7 +106,15 @@ MaterialInfoTable::MaterialInfoTable(unsigned int numOfEntries) {
 MaterialInfoTable::~MaterialInfoTable() {
 
   delete funcs;
-  delete [] entries;
+  page_free(entries, size * sizeof(MaterialInfo));
+}
+
+
+/// MaterialInfoTable::bind_to_node() moves the table to the given NUMA node
+
+void MaterialInfoTable::bind_to_node(int node) {
+
+  bind_memory_to_node(entries, size * sizeof(MaterialInfo), node);
 }
 
 
@@ -26,6 +26,7 @@
 ////
 
 #include "endgame.h"
+#include "misc.h"
 #include "position.h"
 #include "scale.h"
 
@@ -90,6 +91,8 @@ public:
   MaterialInfoTable(unsigned numOfEntries);
   ~MaterialInfoTable();
   MaterialInfo* get_material_info(const Position& pos);
+  void prefetch(Key materialKey) const;
+  void bind_to_node(int node);
 
 private:
   unsigned size;
@@ -116,6 +119,15 @@ inline Value MaterialInfo::eg_value() const {
 }
 
 
+/// MaterialInfoTable::prefetch() preloads in cache the slot that will be
+/// looked up by get_material_info() for the given material key.
+
+inline void MaterialInfoTable::prefetch(Key materialKey) const {
+
+  ::prefetch((const char*)(entries + unsigned(materialKey & (size - 1))));
+}
+
+
 /// MaterialInfo::clear() resets a MaterialInfo object to an empty state,
 /// with all slots at their default values but the key.
 
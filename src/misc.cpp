@@ -24,10 +24,21 @@
 
 #if !defined(_MSC_VER)
 
+#  include <sys/mman.h>
 #  include <sys/time.h>
+#  include <time.h>
 #  include <sys/types.h>
 #  include <unistd.h>
 
+#  if defined(__linux__)
+#    include <sched.h>
+#    include <sys/syscall.h>
+#    if defined(USE_LIBNUMA)
+#      include <numa.h>
+#      include <numaif.h>
+#    endif
+#  endif
+
 #else
 /*
    (c) Copyright 1992 Eric Backus
@@ -59,11 +70,14 @@ static int gettimeofday(struct timeval* tp, struct timezone*)
 
 #endif
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 #include "bitcount.h"
 #include "misc.h"
@@ -195,13 +209,31 @@ int get_system_time() {
 }
 
 
+/// get_system_nanos() returns a monotonic time in nanoseconds, used to
+/// time short events like setting up a split point.
+
+int64_t get_system_nanos() {
+
+#if !defined(_MSC_VER)
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+#else
+  LARGE_INTEGER f, c;
+  QueryPerformanceFrequency(&f);
+  QueryPerformanceCounter(&c);
+  return int64_t(double(c.QuadPart) * 1e9 / double(f.QuadPart));
+#endif
+}
+
+
 /// cpu_count() tries to detect the number of CPU cores.
 
 #if !defined(_MSC_VER)
 
 #  if defined(_SC_NPROCESSORS_ONLN)
 int cpu_count() {
-  return Min(sysconf(_SC_NPROCESSORS_ONLN), 8);
+  return Max(int(sysconf(_SC_NPROCESSORS_ONLN)), 1);
 }
 #  else
 int cpu_count() {
@@ -214,81 +246,339 @@ int cpu_count() {
 int cpu_count() {
   SYSTEM_INFO s;
   GetSystemInfo(&s);
-  return Min(s.dwNumberOfProcessors, 8);
+  return Max(int(s.dwNumberOfProcessors), 1);
 }
 
 #endif
 
 
-/*
-  From Beowulf, from Olithink
-*/
-#ifndef _WIN32
-/* Non-windows version */
-int Bioskey()
-{
-  fd_set          readfds;
-  struct timeval  timeout;
+/// page_alloc() returns a block of zeroed, page aligned memory, so that it
+/// does not share any page with other data and can be moved alone to a NUMA
+/// node. Returns NULL on failure. page_free() releases it.
 
-  FD_ZERO(&readfds);
-  FD_SET(fileno(stdin), &readfds);
-  /* Set to timeout immediately */
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 0;
-  select(16, &readfds, 0, 0, &timeout);
+void* page_alloc(size_t bytes) {
 
-  return (FD_ISSET(fileno(stdin), &readfds));
+#if !defined(_MSC_VER)
+  void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  return mem == MAP_FAILED ? NULL : mem;
+#else
+  return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#endif
 }
 
+void page_free(void* mem, size_t bytes) {
+
+  if (!mem)
+      return;
+
+#if !defined(_MSC_VER)
+  munmap(mem, bytes);
 #else
-/* Windows-version */
-#include <windows.h>
-#include <conio.h>
-int Bioskey()
-{
-    static int      init = 0,
-                    pipe;
-    static HANDLE   inh;
-    DWORD           dw;
-    /* If we're running under XBoard then we can't use _kbhit() as the input
-     * commands are sent to us directly over the internal pipe */
-
-#if defined(FILE_CNT)
-    if (stdin->_cnt > 0)
-        return stdin->_cnt;
+  VirtualFree(mem, 0, MEM_RELEASE);
+  bytes = 0; // Silence a warning
 #endif
-    if (!init) {
-        init = 1;
-        inh = GetStdHandle(STD_INPUT_HANDLE);
-        pipe = !GetConsoleMode(inh, &dw);
-        if (!pipe) {
-            SetConsoleMode(inh, dw & ~(ENABLE_MOUSE_INPUT | ENABLE_WINDOW_INPUT));
-            FlushConsoleInputBuffer(inh);
+}
+
+
+/// NUMA support. On Linux we talk directly to the kernel with the mbind()
+/// and set_mempolicy() system calls, or through libnuma when compiled with
+/// -DUSE_LIBNUMA (and linked with -lnuma). On other systems all the NUMA
+/// functions do nothing and node_count() is 1. A node equal to -1 means
+/// "no node", that is the default policy of the system.
+
+#if defined(__linux__)
+
+namespace {
+
+#  if !defined(MPOL_DEFAULT)
+#    define MPOL_DEFAULT    0
+#    define MPOL_PREFERRED  1
+#    define MPOL_BIND       2
+#    define MPOL_INTERLEAVE 3
+#  endif
+
+#  if !defined(MPOL_MF_MOVE)
+#    define MPOL_MF_MOVE (1 << 1)
+#  endif
+
+  const int MaxNodes = 1024;
+
+  struct NodeMask {
+    unsigned long bits[MaxNodes / (8 * sizeof(unsigned long))];
+  };
+
+  void set_node(NodeMask& m, int node) {
+
+    const int w = 8 * sizeof(unsigned long);
+    m.bits[node / w] |= 1UL << (node % w);
+  }
+
+  // Kernel takes maxnode as the number of bits plus one
+  long do_mbind(void* mem, size_t bytes, int mode, NodeMask* m) {
+
+#  if defined(USE_LIBNUMA)
+    return mbind(mem, bytes, mode, m ? m->bits : NULL, m ? MaxNodes + 1 : 0, MPOL_MF_MOVE);
+#  else
+    return syscall(SYS_mbind, mem, bytes, mode, m ? m->bits : NULL, m ? MaxNodes + 1 : 0, MPOL_MF_MOVE);
+#  endif
+  }
+
+  // read_cpu_list() reads a list of CPUs from a sysfs file, as a list of
+  // ranges in the form "0-7,16-23".
+  bool read_cpu_list(const std::string& path, cpu_set_t* cpus) {
+
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+
+    CPU_ZERO(cpus);
+    int first, last;
+    char sep;
+
+    while (fscanf(f, "%d", &first) == 1)
+    {
+        last = first;
+        if (fscanf(f, "%c", &sep) == 1 && sep == '-')
+        {
+            if (fscanf(f, "%d", &last) != 1)
+                break;
+            if (fscanf(f, "%c", &sep) != 1)
+                sep = 0;
         }
+        for (int c = first; c <= last && c < CPU_SETSIZE; c++)
+            CPU_SET(c, cpus);
+
+        if (sep != ',')
+            break;
     }
-    if (pipe) {
-        if (!PeekNamedPipe(inh, NULL, 0, NULL, &dw, NULL))
-            return 1;
-        return dw;
-    } else {
-        // Count the number of unread input records, including keyboard,
-        // mouse, and window-resizing input records.
-        GetNumberOfConsoleInputEvents(inh, &dw);
-        if (dw <= 0)
-            return 0;
-
-        // Read data from console without removing it from the buffer
-        INPUT_RECORD rec[256];
-        DWORD recCnt;
-        if (!PeekConsoleInput(inh, rec, Min(dw, 256), &recCnt))
-            return 0;
-
-        // Search for at least one keyboard event
-        for (DWORD i = 0; i < recCnt; i++)
-            if (rec[i].EventType == KEY_EVENT)
-                return 1;
-
-        return 0;
-    }
+    fclose(f);
+    return true;
+  }
+
+  // node_cpus() reads from sysfs the CPUs of the given node
+  bool node_cpus(int node, cpu_set_t* cpus) {
+
+    std::ostringstream path;
+    path << "/sys/devices/system/node/node" << node << "/cpulist";
+    return read_cpu_list(path.str(), cpus);
+  }
 }
+
 #endif
+
+
+/// node_count() returns the number of NUMA nodes of the machine
+
+int node_count() {
+
+#if defined(__linux__) && defined(USE_LIBNUMA)
+  return numa_available() < 0 ? 1 : Max(numa_num_configured_nodes(), 1);
+#elif defined(__linux__)
+  static int nodes = 0;
+
+  if (!nodes)
+  {
+      cpu_set_t cpus;
+      while (nodes < MaxNodes && node_cpus(nodes, &cpus))
+          nodes++;
+
+      nodes = Max(nodes, 1);
+  }
+  return nodes;
+#else
+  return 1;
+#endif
+}
+
+
+/// bind_thread_to_node() restricts the calling thread to the CPUs of the
+/// given node, and makes the node the preferred one for the memory later
+/// allocated by the thread. With node -1 the thread can run everywhere.
+
+void bind_thread_to_node(int node) {
+
+#if defined(__linux__)
+  cpu_set_t cpus;
+
+  if (node < 0 || !node_cpus(node, &cpus))
+  {
+      CPU_ZERO(&cpus);
+      for (int c = 0; c < CPU_SETSIZE; c++)
+          CPU_SET(c, &cpus);
+  }
+  sched_setaffinity(0, sizeof(cpu_set_t), &cpus);
+
+  NodeMask m = NodeMask();
+  if (node >= 0)
+      set_node(m, node);
+
+#  if defined(USE_LIBNUMA)
+  set_mempolicy(node >= 0 ? MPOL_PREFERRED : MPOL_DEFAULT, node >= 0 ? m.bits : NULL, node >= 0 ? MaxNodes + 1 : 0);
+#  else
+  syscall(SYS_set_mempolicy, node >= 0 ? MPOL_PREFERRED : MPOL_DEFAULT, node >= 0 ? m.bits : NULL, node >= 0 ? MaxNodes + 1 : 0);
+#  endif
+#else
+  node = 0; // Silence a warning
+#endif
+}
+
+
+/// bind_memory_to_node() moves a block returned by page_alloc() to the given
+/// node, and keeps it there. With node -1 the block goes back to the default
+/// policy, pages already in place are not moved.
+
+void bind_memory_to_node(void* mem, size_t bytes, int node) {
+
+#if defined(__linux__)
+  if (!mem)
+      return;
+
+  if (node < 0)
+  {
+      do_mbind(mem, bytes, MPOL_DEFAULT, NULL);
+      return;
+  }
+
+  NodeMask m = NodeMask();
+  set_node(m, node);
+  do_mbind(mem, bytes, MPOL_PREFERRED, &m);
+#else
+  mem = NULL; bytes = node = 0; // Silence a warning
+#endif
+}
+
+
+/// interleave_memory() spreads the pages of a block over all the nodes in
+/// round robin. To be effective it must be called before the block is first
+/// touched, pages already in place are moved only if the kernel can.
+
+void interleave_memory(void* mem, size_t bytes) {
+
+#if defined(__linux__)
+  if (!mem || node_count() < 2)
+      return;
+
+  NodeMask m = NodeMask();
+  for (int n = 0; n < node_count(); n++)
+      set_node(m, n);
+
+  do_mbind(mem, bytes, MPOL_INTERLEAVE, &m);
+#else
+  mem = NULL; bytes = 0; // Silence a warning
+#endif
+}
+
+
+/// CPU placement. To pin the search threads, the CPUs are taken in the order
+/// computed by init_cpu_order(): first one logical CPU of every physical
+/// core, then the remaining SMT siblings, so that two threads share a core
+/// only when there are more threads than cores.
+
+namespace {
+
+  std::vector<int> CpuOrder;
+}
+
+
+/// init_cpu_order() computes the order in which the CPUs are handed out to
+/// the threads. On Linux only the CPUs the process is allowed to run on are
+/// used, and the SMT siblings of each CPU are read from the sysfs topology.
+/// It must be called at startup, before any thread is bound to a CPU or to
+/// a node, otherwise the allowed CPUs would be those of the binding.
+
+void init_cpu_order() {
+
+  CpuOrder.clear();
+
+#if defined(__linux__)
+  cpu_set_t allowed;
+  std::vector<std::pair<int, int> > cpus; // Rank among its siblings, CPU
+
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+  {
+      CPU_ZERO(&allowed);
+      for (int c = 0; c < cpu_count() && c < CPU_SETSIZE; c++)
+          CPU_SET(c, &allowed);
+  }
+
+  for (int c = 0; c < CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &allowed))
+      {
+          std::ostringstream path;
+          path << "/sys/devices/system/cpu/cpu" << c << "/topology/thread_siblings_list";
+
+          cpu_set_t siblings;
+          int rank = 0;
+
+          if (read_cpu_list(path.str(), &siblings))
+              for (int s = 0; s < c; s++)
+                  if (CPU_ISSET(s, &siblings))
+                      rank++;
+
+          cpus.push_back(std::make_pair(rank, c));
+      }
+
+  std::sort(cpus.begin(), cpus.end());
+
+  for (size_t i = 0; i < cpus.size(); i++)
+      CpuOrder.push_back(cpus[i].second);
+#endif
+
+  if (CpuOrder.empty())
+      for (int c = 0; c < cpu_count(); c++)
+          CpuOrder.push_back(c);
+}
+
+
+/// logical_cpu() returns the CPU where to place the n-th search thread. With
+/// more threads than CPUs the order starts again from the first.
+
+int logical_cpu(int n) {
+
+  if (CpuOrder.empty())
+      init_cpu_order();
+
+  return CpuOrder[n % CpuOrder.size()];
+}
+
+
+/// cpu_node() returns the NUMA node of the given CPU, or -1 if unknown
+
+int cpu_node(int cpu) {
+
+#if defined(__linux__)
+  cpu_set_t cpus;
+
+  for (int node = 0; node < node_count(); node++)
+      if (node_cpus(node, &cpus) && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &cpus))
+          return node;
+#else
+  cpu = 0; // Silence a warning
+#endif
+  return -1;
+}
+
+
+/// bind_thread_to_cpu() pins the calling thread to the given logical CPU.
+/// With cpu -1 the thread can run everywhere again.
+
+void bind_thread_to_cpu(int cpu) {
+
+#if defined(__linux__)
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+
+  if (cpu >= 0 && cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &cpus);
+  else
+      for (int c = 0; c < CPU_SETSIZE; c++)
+          CPU_SET(c, &cpus);
+
+  sched_setaffinity(0, sizeof(cpu_set_t), &cpus);
+#elif defined(_MSC_VER)
+  DWORD_PTR mask = (cpu >= 0 && cpu < int(8 * sizeof(DWORD_PTR))) ? DWORD_PTR(1) << cpu : ~DWORD_PTR(0);
+  SetThreadAffinityMask(GetCurrentThread(), mask);
+#else
+  cpu = 0; // Silence a warning
+#endif
+}
@@ -48,6 +48,15 @@ namespace {
   int QsearchWithChecksPhaseIndex;
   int QsearchWithoutChecksPhaseIndex;
 
+  // Number of moves picked by a scan of the list, see find_best_move()
+  const int LazyPicks = 3;
+
+  bool LazyOrdering = true;
+
+  // Ordering bonus of the countermove of the previous move, see
+  // score_noncaptures(). It does not always bring it first.
+  const int CounterMoveBonus = HistoryMax / 5;
+
 }
 
 
@@ -71,11 +80,29 @@ MovePicker::MovePicker(const Position& p, Move ttm, Depth d,
       mateKiller = (ss->mateKiller == ttm)? MOVE_NONE : ss->mateKiller;
       killer1 = ss->killers[0];
       killer2 = ss->killers[1];
+
+      // The search stack is the one of a node at ply > 0, the entry before
+      // holds the move which has led to the current position.
+      prevMove = (ss - 1)->currentMove;
   } else
-      mateKiller = killer1 = killer2 = MOVE_NONE;
+      mateKiller = killer1 = killer2 = prevMove = MOVE_NONE;
+
+  // The destination square of a castling move, the one of the rook, may
+  // be empty now, there is no countermove then.
+  prevPiece = EMPTY;
+  if (move_is_ok(prevMove) && H.follow_up_in_use())
+  {
+      prevTo = move_to(prevMove);
+      prevPiece = p.piece_on(prevTo);
+  }
+
+  if (piece_is_ok(prevPiece))
+      counterMove = H.counter_move(prevPiece, prevTo);
+  else
+      prevMove = counterMove = MOVE_NONE;
 
   movesPicked = numOfMoves = numOfBadCaptures = 0;
-  checkKillers = checkLegal = finished = false;
+  checkKillers = checkLegal = unsorted = false;
 
   if (p.is_check())
       phaseIndex = EvasionsPhaseIndex;
@@ -90,8 +117,6 @@ MovePicker::MovePicker(const Position& p, Move ttm, Depth d,
 
   dc = p.discovered_check_candidates(us);
   pinned = p.pinned_pieces(us);
-
-  finished = false;
 }
 
 
@@ -139,14 +164,14 @@ Move MovePicker::get_next_move() {
     case PH_GOOD_CAPTURES:
         numOfMoves = generate_captures(pos, moves);
         score_captures();
-        std::sort(moves, moves + numOfMoves);
+        order_moves(moves, numOfMoves);
         movesPicked = 0;
         checkLegal = true;
         break;
 
     case PH_KILLERS:
         movesPicked = numOfMoves = 0;
-        checkLegal = false;
+        checkLegal = unsorted = false;
         if (killer1 != MOVE_NONE && move_is_legal(pos, killer1, pinned) && !pos.move_is_capture(killer1))
             moves[numOfMoves++].move = killer1;
         if (killer2 != MOVE_NONE && move_is_legal(pos, killer2, pinned) && !pos.move_is_capture(killer2) )
@@ -157,7 +182,7 @@ Move MovePicker::get_next_move() {
         checkKillers = (numOfMoves != 0); // previous phase is PH_KILLERS
         numOfMoves = generate_noncaptures(pos, moves);
         score_noncaptures();
-        std::sort(moves, moves + numOfMoves);
+        order_moves(moves, numOfMoves);
         movesPicked = 0;
         checkLegal = true;
         break;
@@ -165,7 +190,7 @@ Move MovePicker::get_next_move() {
     case PH_BAD_CAPTURES:
         // Bad captures SEE value is already calculated by score_captures()
         // so just sort them to get SEE move ordering.
-        std::sort(badCaptures, badCaptures + numOfBadCaptures);
+        order_moves(badCaptures, numOfBadCaptures);
         movesPicked = 0;
         break;
 
@@ -173,14 +198,14 @@ Move MovePicker::get_next_move() {
         assert(pos.is_check());
         numOfMoves = generate_evasions(pos, moves, pinned);
         score_evasions();
-        std::sort(moves, moves + numOfMoves);
+        order_moves(moves, numOfMoves);
         movesPicked = 0;
         break;
 
     case PH_QCAPTURES:
         numOfMoves = generate_captures(pos, moves);
         score_qcaptures();
-        std::sort(moves, moves + numOfMoves);
+        order_moves(moves, numOfMoves);
         movesPicked = 0;
         break;
 
@@ -188,6 +213,7 @@ Move MovePicker::get_next_move() {
         // Perhaps we should order moves move here?  FIXME
         numOfMoves = generate_non_capture_checks(pos, moves, dc);
         movesPicked = 0;
+        unsorted = false;
         break;
 
     case PH_STOP:
@@ -201,26 +227,6 @@ Move MovePicker::get_next_move() {
 }
 
 
-/// A variant of get_next_move() which takes a lock as a parameter, used to
-/// prevent multiple threads from picking the same move at a split point.
-
-Move MovePicker::get_next_move(Lock &lock) {
-
-   lock_grab(&lock);
-   if (finished)
-   {
-       lock_release(&lock);
-       return MOVE_NONE;
-   }
-   Move m = get_next_move();
-   if (m == MOVE_NONE)
-       finished = true;
-
-   lock_release(&lock);
-   return m;
-}
-
-
 /// MovePicker::score_captures(), MovePicker::score_noncaptures(),
 /// MovePicker::score_evasions() and MovePicker::score_qcaptures() assign a
 /// numerical move ordering score to each move in a move list.  The moves
@@ -265,9 +271,12 @@ void MovePicker::score_captures() {
 }
 
 void MovePicker::score_noncaptures() {
-  // First score by history, when no history is available then use
+  // First score by history, with the follow-up history of the replies to
+  // the previous move, when no history is available then use
   // piece/square tables values. This seems to be better then a
-  // random choice when we don't have an history for any move.
+  // random choice when we don't have an history for any move. The
+  // follow-up history counts twice, and the countermove of the previous
+  // move gets a bonus.
   Piece piece;
   Square from, to;
   int hs;
@@ -279,10 +288,16 @@ void MovePicker::score_noncaptures() {
       piece = pos.piece_on(from);
       hs = H.move_ordering_score(piece, to);
 
+      if (prevMove != MOVE_NONE)
+          hs += 2 * H.follow_up_score(prevPiece, prevTo, piece, to);
+
       // Ensure history is always preferred to pst
       if (hs > 0)
           hs += 1000;
 
+      if (moves[i].move == counterMove)
+          hs += CounterMoveBonus;
+
       // pst based scoring
       moves[i].score = hs + pos.pst_delta<Position::MidGame>(piece, from, to);
   }
@@ -319,6 +334,44 @@ void MovePicker::score_qcaptures() {
 }
 
 
+/// MovePicker::order_moves() is called on a new list of scored moves. With
+/// lazy ordering it only marks the list as unsorted, otherwise it sorts it.
+
+void MovePicker::order_moves(MoveStack* list, int n) {
+
+  unsorted = LazyOrdering;
+  if (!unsorted)
+      std::sort(list, list + n);
+}
+
+
+/// MovePicker::find_best_move() brings the best of the moves left in an
+/// unsorted list to position movesPicked. The first LazyPicks moves are
+/// found by a linear scan, after that the moves left are sorted all at once,
+/// so that a node searching many moves does not cost a quadratic time.
+
+void MovePicker::find_best_move(MoveStack* list, int n) {
+
+  if (movesPicked >= n)
+      return;
+
+  if (movesPicked < LazyPicks)
+  {
+      int best = movesPicked;
+      for (int i = movesPicked + 1; i < n; i++)
+          if (list[i].score > list[best].score)
+              best = i;
+
+      std::swap(list[movesPicked], list[best]);
+  }
+  else
+  {
+      std::sort(list + movesPicked, list + n);
+      unsorted = false;
+  }
+}
+
+
 /// MovePicker::pick_move_from_list() picks the move with the biggest score
 /// from a list of generated moves (moves[] or badCaptures[], depending on
 /// the current move generation phase).  It takes care not to return the
@@ -337,6 +390,9 @@ Move MovePicker::pick_move_from_list() {
   case PH_NONCAPTURES:
       while (movesPicked < numOfMoves)
       {
+          if (unsorted)
+              find_best_move(moves, numOfMoves);
+
           Move move = moves[movesPicked++].move;
           if (   move != ttMove
               && move != mateKiller
@@ -347,6 +403,9 @@ Move MovePicker::pick_move_from_list() {
       break;
 
   case PH_EVASIONS:
+      if (unsorted)
+          find_best_move(moves, numOfMoves);
+
       if (movesPicked < numOfMoves)
           return moves[movesPicked++].move;
 
@@ -355,6 +414,9 @@ Move MovePicker::pick_move_from_list() {
   case PH_BAD_CAPTURES:
       while (movesPicked < numOfBadCaptures)
       {
+          if (unsorted)
+              find_best_move(badCaptures, numOfBadCaptures);
+
           Move move = badCaptures[movesPicked++].move;
           if (   move != ttMove
               && move != mateKiller
@@ -367,6 +429,9 @@ Move MovePicker::pick_move_from_list() {
   case PH_QCHECKS:
       while (movesPicked < numOfMoves)
       {
+          if (unsorted)
+              find_best_move(moves, numOfMoves);
+
           Move move = moves[movesPicked++].move;
           // Maybe postpone the legality check until after futility pruning?
           if (   move != ttMove
@@ -389,7 +454,11 @@ Move MovePicker::pick_move_from_list() {
 
 void MovePicker::init_phase_table() {
 
+  // The phase indexes point to the slot before the first phase, which
+  // get_next_move() reads before to move to the next phase. Slot 0 is
+  // that slot for the main search.
   int i = 0;
+  PhaseTable[i++] = PH_STOP;
 
   // Main search
   MainSearchPhaseIndex = i - 1;
@@ -419,3 +488,12 @@ void MovePicker::init_phase_table() {
   PhaseTable[i++] = PH_QCAPTURES;
   PhaseTable[i++] = PH_STOP;
 }
+
+
+/// MovePicker::set_lazy_ordering() selects how the move lists are ordered,
+/// see the class definition. Lazy ordering is the default.
+
+void MovePicker::set_lazy_ordering(bool lazy) {
+
+  LazyOrdering = lazy;
+}
@@ -27,7 +27,6 @@
 
 #include "depth.h"
 #include "history.h"
-#include "lock.h"
 #include "position.h"
 
 
@@ -45,6 +44,12 @@ struct SearchStack;
 /// is called, until there are no legal moves left, when MOVE_NONE is returned.
 /// In order to improve the efficiency of the alpha beta algorithm, MovePicker
 /// attempts to return the moves which are most likely to be strongest first.
+///
+/// As most nodes cut off after one or two moves, the lists are not sorted
+/// when generated: the first LazyPicks moves are found one at a time by a
+/// scan for the best score, and only if more are asked for, the rest of the
+/// list is sorted at once. set_lazy_ordering(false) sorts the whole list at
+/// generation, as done before, for the movepick benchmark.
 
 class MovePicker {
 
@@ -67,29 +72,34 @@ public:
 
   MovePicker(const Position& p, Move ttm, Depth d, const History& h, SearchStack* ss = NULL);
   Move get_next_move();
-  Move get_next_move(Lock& lock);
   int number_of_moves() const;
   Bitboard discovered_check_candidates() const;
 
   static void init_phase_table();
+  static void set_lazy_ordering(bool lazy);
 
 private:
   void score_captures();
   void score_noncaptures();
   void score_evasions();
   void score_qcaptures();
+  void order_moves(MoveStack* list, int n);
+  void find_best_move(MoveStack* list, int n);
   Move pick_move_from_list();
 
   const Position& pos;
   const History& H;
   Move ttMove, mateKiller, killer1, killer2;
+  Move prevMove, counterMove;
+  Piece prevPiece;
+  Square prevTo;
   Bitboard pinned, dc;
   MoveStack moves[256], badCaptures[64];
   int phaseIndex;
   int numOfMoves, numOfBadCaptures;
   int movesPicked;
   bool checkKillers, checkLegal;
-  bool finished;
+  bool unsorted; // The moves left in the current list are not sorted yet
 };
 
 
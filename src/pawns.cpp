@@ -23,6 +23,7 @@
 ////
 
 #include <cassert>
+#include <new>
 
 #include "bitcount.h"
 #include "pawns.h"
@@ -139,20 +140,31 @@ namespace {
 PawnInfoTable::PawnInfoTable(unsigned numOfEntries) {
 
   size = numOfEntries;
-  entries = new PawnInfo[size];
+
+  // Page aligned, so that the table can be moved to the node of its thread
+  entries = (PawnInfo*)page_alloc(size * sizeof(PawnInfo));
   if (entries == NULL)
   {
       std::cerr << "Failed to allocate " << (numOfEntries * sizeof(PawnInfo))
                 << " bytes for pawn hash table." << std::endl;
       Application::exit_with_failure();
   }
+  for (unsigned i = 0; i < size; i++)
+      new (entries + i) PawnInfo();
 }
 
 
 /// Destructor
 
 PawnInfoTable::~PawnInfoTable() {
-  delete [] entries;
+  page_free(entries, size * sizeof(PawnInfo));
+}
+
+
+/// PawnInfoTable::bind_to_node() moves the table to the given NUMA node
+
+void PawnInfoTable::bind_to_node(int node) {
+  bind_memory_to_node(entries, size * sizeof(PawnInfo), node);
 }
 
 
@@ -26,6 +26,7 @@
 ////
 
 #include "bitboard.h"
+#include "misc.h"
 #include "value.h"
 
 ////
@@ -81,6 +82,8 @@ public:
   PawnInfoTable(unsigned numOfEntries);
   ~PawnInfoTable();
   PawnInfo* get_pawn_info(const Position& pos);
+  void prefetch(Key pawnKey) const;
+  void bind_to_node(int node);
 
 private:
   unsigned size;
@@ -133,6 +136,14 @@ inline void PawnInfo::setKingShelter(Color c, Square ksq, int value) {
   kingShelters[c] = (int16_t)value;
 }
 
+/// PawnInfoTable::prefetch() preloads in cache the slot that will be
+/// looked up by get_pawn_info() for the given pawn key.
+
+inline void PawnInfoTable::prefetch(Key pawnKey) const {
+
+  ::prefetch((const char*)(entries + int(pawnKey & (size - 1))));
+}
+
 inline void PawnInfo::clear() {
 
   passedPawns = EmptyBoardBB;
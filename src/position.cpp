@@ -34,6 +34,7 @@
 #include "position.h"
 #include "psqtab.h"
 #include "san.h"
+#include "tt.h"
 #include "ucioption.h"
 
 using std::string;
@@ -804,6 +805,9 @@ void Position::do_move(Move m, StateInfo& newSt, Bitboard dcCandidates) {
         st->key ^= zobCastle[st->castleRights];
     }
 
+    // Prefetch TT access as soon as we know key is updated
+    TT.prefetch(st->key ^ zobSideToMove);
+
     // Update checkers bitboard, piece must be already moved
     st->checkersBB = EmptyBoardBB;
     Square ksq = king_square(them);
@@ -1426,6 +1430,8 @@ void Position::do_null_move(StateInfo& backupSt) {
   gamePly++;
   st->key ^= zobSideToMove;
 
+  TT.prefetch(st->key);
+
   st->mgValue += (sideToMove == WHITE)? TempoValueMidgame : -TempoValueMidgame;
   st->egValue += (sideToMove == WHITE)? TempoValueEndgame : -TempoValueEndgame;
 
@@ -22,15 +22,18 @@
 //// Includes
 ////
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <new>
 #include <sstream>
 
 #include "book.h"
 #include "evaluate.h"
 #include "history.h"
+#include "input.h"
 #include "misc.h"
 #include "movegen.h"
 #include "movepick.h"
@@ -75,11 +78,11 @@ namespace {
   // normally have score -VALUE_INFINITE, so are ordered according
   // to the number of beta cutoffs occurred under their subtree during
   // the last iteration. The counters are per thread variables to avoid
-  // concurrent accessing under SMP case.
+  // concurrent accessing under SMP case. They start at zero because the
+  // Thread objects are allocated zeroed, see init_threads().
 
   struct BetaCounterType {
 
-    BetaCounterType();
     void clear();
     void add(Color us, Depth d, int threadID);
     void read(Color us, int64_t& our, int64_t& their);
@@ -189,10 +192,6 @@ namespace {
   // Remaining depth:                 1 ply         1.5 ply       2 ply         2.5 ply       3 ply         3.5 ply
   const Value RazorApprMargins[6] = { Value(0x520), Value(0x300), Value(0x300), Value(0x300), Value(0x300), Value(0x300) };
 
-  // The main transposition table
-  TranspositionTable TT;
-
-
   /// Variables initialized by UCI options
 
   // Minimum number of full depth (i.e. non-reduced) moves at PV and non-PV nodes
@@ -230,6 +229,14 @@ namespace {
   Move EasyMove;
   int RootMoveNumber;
   bool InfiniteSearch;
+
+  // With "Deterministic" and a depth or node limit the search does not look
+  // at the clock: it stops only on that limit or on a command, poll() is
+  // called at a fixed node interval, and the output has no time dependent
+  // field. With one thread the same limit then always gives the same output.
+  // Without such a limit, as when playing on the clock, the option is
+  // ignored, the search would never stop by itself.
+  bool Deterministic;
   bool PonderSearch;
   bool StopOnPonderhit;
   bool AbortSearch; // heavy SMP read access
@@ -251,29 +258,58 @@ namespace {
   int ActiveThreads = 1;
   Depth MinimumSplitDepth;
   int MaxThreadsPerSplitPoint;
-  Thread Threads[THREAD_MAX];
+  bool UseNUMA = false;
+  bool UseAffinity = false;
+  bool UseLateJoin;
+  bool UseLazySMP;
+  bool UseRootSplit;
+  bool UseThreadHistory;
+  bool UseFollowUp;
+  RootMoveList* RootMoves; // Root move list of a root split point
+  const Position* LazyRootPosition; // Root of the helpers in Lazy SMP mode
+  Move* LazySearchMoves;
+  Thread** Threads;
   Lock MPLock;
   Lock IOLock;
   bool AllThreadsShouldExit = false;
   const int MaxActiveSplitPoints = 8;
-  SplitPoint SplitPointStack[THREAD_MAX][MaxActiveSplitPoints];
+  SplitPoint** SplitPointStack;
   bool Idle = true;
+  int64_t SearchStartNanos;
+  int64_t SearchNanos; // Duration of the last think()
 
-#if !defined(_MSC_VER)
-  pthread_cond_t WaitCond;
-  pthread_mutex_t WaitLock;
-#else
-  HANDLE SitIdleEvent[THREAD_MAX];
+#if defined(SMP_STATS)
+  SMPStats SMPTotal; // Since program start
 #endif
 
+  // An idle helper thread spins for a while before to go to sleep, see
+  // idle_loop(). The spin time of each thread adapts between these bounds.
+  const int64_t MinSpinNanos = 2000;
+  const int64_t MaxSpinNanos = 500000;
+
   // Node counters, used only by thread[0] but try to keep in different
   // cache lines (64 bytes each) from the heavy SMP read accessed variables.
   int NodesSincePoll;
   int NodesBetweenPolls = 30000;
 
+  // With a node limit each thread adds its nodes to the shared counter in
+  // batches, see init_node(). The counter has a cache line of its own, as
+  // it is written by all the threads.
+  const int NodesBatch = 256;
+
+  struct {
+    unsigned char pad[64];
+    volatile int64_t value;
+    unsigned char pad2[64];
+  } NodesFlushed;
+
   // History table
   History H;
 
+  // With "Thread History", the table all the threads have started the
+  // current iteration from, see merge_histories()
+  History HistoryBase;
+
 
   /// Functions
 
@@ -284,6 +320,7 @@ namespace {
   Value qsearch(Position& pos, SearchStack ss[], Value alpha, Value beta, Depth depth, int ply, int threadID);
   void sp_search(SplitPoint* sp, int threadID);
   void sp_search_pv(SplitPoint* sp, int threadID);
+  void sp_search_root(SplitPoint* sp, int threadID);
   void init_node(SearchStack ss[], int ply, int threadID);
   void update_pv(SearchStack ss[], int ply);
   void sp_update_pv(SearchStack* pss, SearchStack ss[], int ply);
@@ -292,30 +329,51 @@ namespace {
   bool move_is_killer(Move m, const SearchStack& ss);
   Depth extension(const Position& pos, Move m, bool pvNode, bool capture, bool check, bool singleReply, bool mateThreat, bool* dangerous);
   bool ok_to_do_nullmove(const Position& pos);
-  bool ok_to_prune(const Position& pos, Move m, Move threat, Depth d);
+  bool ok_to_prune(const Position& pos, Move m, Move threat, Depth d, int threadID);
   bool ok_to_use_TT(const TTEntry* tte, Depth depth, Value beta, int ply);
   bool ok_to_history(const Position& pos, Move m);
-  void update_history(const Position& pos, Move m, Depth depth, Move movesSearched[], int moveCount);
+  History& thread_history(int threadID);
+  void merge_histories();
+  void update_history(const Position& pos, Move m, Move prevMove, Depth depth, Move movesSearched[], int moveCount, int threadID);
   void update_killers(Move m, SearchStack& ss);
 
   bool fail_high_ply_1();
   int current_search_time();
+  std::string time_and_nps();
   int nps();
   void poll();
   void ponderhit();
   void print_current_line(SearchStack ss[], int ply, int threadID);
+  void print_pv_info(const Position& pos, SearchStack ss[], Value value);
   void wait_for_stop_or_ponderhit();
 
   void idle_loop(int threadID, SplitPoint* waitSp);
+  void create_threads(int n);
+  void destroy_threads();
   void init_split_point_stack();
   void destroy_split_point_stack();
+  void place_threads();
+  void bind_thread(int threadID);
   bool thread_should_stop(int threadID);
+  bool raise_value(volatile Value* v, Value value);
   bool thread_is_available(int slave, int master);
   bool idle_thread_exists(int master);
+  bool can_join(const SplitPoint* sp, int threadID);
+  void late_join(int threadID);
+  void start_lazy_helpers(const Position& pos, Move searchMoves[]);
+  void stop_lazy_helpers();
+  void lazy_search(int threadID);
   bool split(const Position& pos, SearchStack* ss, int ply,
              Value *alpha, Value *beta, Value *bestValue, Depth depth, int *moves,
              MovePicker *mp, Bitboard dcCandidates, int master, bool pvNode);
+  void sleep_until_woken(int threadID);
+  void wake_thread(int threadID);
   void wake_sleeping_threads();
+  void grab_sp_lock(SplitPoint* sp, int threadID);
+  void print_smp_stats(std::ostream& os, const std::string& prefix);
+#if defined(SMP_STATS)
+  SMPStats thread_smp_stats(int threadID);
+#endif
 
 #if !defined(_MSC_VER)
   void *init_thread(void *threadID);
@@ -355,13 +413,18 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
   }
 
   // Initialize global search variables
+  SearchStartNanos = get_system_nanos();
   Idle = false;
   SearchStartTime = get_system_time();
   EasyMove = MOVE_NONE;
-  for (int i = 0; i < THREAD_MAX; i++)
+  for (int i = 0; i < ActiveThreads; i++)
   {
-      Threads[i].nodes = 0ULL;
-      Threads[i].failHighPly1 = false;
+      Threads[i]->nodes = 0ULL;
+      Threads[i]->failHighPly1 = false;
+      Threads[i]->splits = Threads[i]->splitNanos = 0;
+      Threads[i]->lateJoins = Threads[i]->idleNanos = Threads[i]->busyNanos = 0;
+      Threads[i]->wakeups = Threads[i]->wakeNanos = 0;
+      SMP_STATS_DO(Threads[i]->smpStats.clear());
   }
   NodesSincePoll = 0;
   InfiniteSearch = infinite;
@@ -373,10 +436,14 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
   FailLow = false;
   Problem = false;
   ExactMaxTime = maxTime;
+  Deterministic = get_option_value_bool("Deterministic") && (maxDepth || maxNodes);
 
   // Read UCI option values
-  TT.set_size(get_option_value_int("Hash"));
-  if (button_was_pressed("Clear Hash"))
+  if (button_was_pressed("Reset Shared Hash"))
+      TT.reset_shared();
+
+  TT.set_size(get_option_value_int("Hash"), page_policy(get_option_value_string("Large Pages")));
+  if (button_was_pressed("Clear Hash") && !TT.shared_with_others())
       TT.clear();
 
   PonderingEnabled = get_option_value_bool("Ponder");
@@ -416,18 +483,43 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
 
   MinimumSplitDepth = get_option_value_int("Minimum Split Depth") * OnePly;
   MaxThreadsPerSplitPoint = get_option_value_int("Maximum Number of Threads per Split Point");
+  UseLateJoin = get_option_value_bool("Late Join");
+  UseLazySMP = (get_option_value_string("SMP Mode") == "Lazy SMP");
+  UseRootSplit = get_option_value_bool("Root Split");
+  UseThreadHistory = get_option_value_bool("Thread History");
+  UseFollowUp = get_option_value_bool("Countermove History");
 
   read_weights(pos.side_to_move());
 
   int newActiveThreads = get_option_value_int("Threads");
-  if (newActiveThreads != ActiveThreads)
+  bool newUseNUMA = get_option_value_bool("NUMA");
+  bool newUseAffinity = get_option_value_bool("Thread Affinity");
+  if (   newActiveThreads != ActiveThreads
+      || newUseNUMA != UseNUMA
+      || newUseAffinity != UseAffinity)
   {
-      ActiveThreads = newActiveThreads;
+      if (newActiveThreads != ActiveThreads)
+      {
+          destroy_threads();
+          create_threads(newActiveThreads);
+      }
+      UseNUMA = newUseNUMA;
+      UseAffinity = newUseAffinity;
       init_eval(ActiveThreads);
+      place_threads();
   }
 
-  // Wake up sleeping threads
-  wake_sleeping_threads();
+  // Helper threads keep sleeping until split() books them, or until
+  // id_loop() starts them in Lazy SMP mode. With "Late Join" they are
+  // woken now, they look for split points to join by themselves.
+  for (int i = 1; i < ActiveThreads; i++)
+  {
+      Threads[i]->idle = true;
+      Threads[i]->workIsWaiting = false;
+  }
+
+  if (UseLateJoin)
+      wake_sleeping_threads();
 
   for (int i = 1; i < ActiveThreads; i++)
       assert(thread_is_available(i, 0));
@@ -471,13 +563,15 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
       InfiniteSearch = true; // HACK
 
   MaxNodes = maxNodes;
+  NodesFlushed.value = 0;
   if (MaxNodes)
-  {
-      NodesBetweenPolls = Min(MaxNodes, 30000);
       InfiniteSearch = true; // HACK
+
+  if (Deterministic)
+  {
+      InfiniteSearch = true;
+      ExactMaxTime = 0;
   }
-  else
-      NodesBetweenPolls = 30000;
 
 
   // Write information to search log file
@@ -487,7 +581,9 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
               << " ponder: "   << ponder
               << " time: "     << myTime
               << " increment: " << myIncrement
-              << " moves to go: " << movesToGo << std::endl;
+              << " moves to go: " << movesToGo << std::endl
+              << "Hash backed by: " << TT.backing() << std::endl
+              << "Hash layout: " << TT.layout() << std::endl;
 
 
   // We're ready to start thinking. Call the iterative deepening loop function
@@ -510,80 +606,172 @@ bool think(const Position& pos, bool infinite, bool ponder, int side_to_move,
   if (UseLogFile)
       LogFile.close();
 
+  SearchNanos = get_system_nanos() - SearchStartNanos;
+  SMP_STATS_DO(SMPTotal.add(smp_stats(false)));
   Idle = true;
   return !Quit;
 }
 
 
-/// init_threads() is called during startup.  It launches all helper threads,
-/// and initializes the split point stack and the global locks and condition
-/// objects.
+/// init_threads() is called during startup.  It initializes the global
+/// locks and condition objects, and the data of the main thread. Helper
+/// threads are launched by think() according to the "Threads" option.
 
 void init_threads() {
 
-  volatile int i;
-
-#if !defined(_MSC_VER)
-  pthread_t pthread[1];
-#endif
-
-  for (i = 0; i < THREAD_MAX; i++)
-      Threads[i].activeSplitPoints = 0;
-
   // Initialize global locks
   lock_init(&MPLock, NULL);
   lock_init(&IOLock, NULL);
 
-  init_split_point_stack();
+  // Read the CPUs we may run on before any thread is bound
+  init_cpu_order();
 
-#if !defined(_MSC_VER)
-  pthread_mutex_init(&WaitLock, NULL);
-  pthread_cond_init(&WaitCond, NULL);
-#else
-  for (i = 0; i < THREAD_MAX; i++)
-      SitIdleEvent[i] = CreateEvent(0, FALSE, FALSE, 0);
-#endif
+  create_threads(1);
+}
+
+
+/// stop_threads() is called when the program exits.  It makes all the
+/// helper threads exit cleanly.
+
+void stop_threads() {
+
+  destroy_threads();
+}
+
+
+/// smp_info() returns the split statistics of the last search, summed over
+/// all the threads, and the size of the search data of each thread. A
+/// helper thread is idle whenever it is not searching for a split point,
+/// or when it waits as the master of a split point inside that search.
+
+SMPInfo smp_info() {
 
-  // All threads except the main thread should be initialized to idle state
-  for (i = 1; i < THREAD_MAX; i++)
+  SMPInfo info;
+
+  info.splits = info.splitNanos = info.lateJoins = info.idleNanos = 0;
+  info.wakeups = info.wakeNanos = 0;
+  info.threadBytes = sizeof(Thread) + MaxActiveSplitPoints * sizeof(SplitPoint);
+
+  for (int i = 0; i < ActiveThreads; i++)
   {
-      Threads[i].stop = false;
-      Threads[i].workIsWaiting = false;
-      Threads[i].idle = true;
-      Threads[i].running = false;
+      info.splits += Threads[i]->splits;
+      info.splitNanos += Threads[i]->splitNanos;
+      info.lateJoins += Threads[i]->lateJoins;
+      info.idleNanos += Threads[i]->idleNanos;
+      info.wakeups += Threads[i]->wakeups;
+      info.wakeNanos += Threads[i]->wakeNanos;
+
+      if (i > 0)
+          info.idleNanos += Max(SearchNanos - Threads[i]->busyNanos, int64_t(0));
   }
+  return info;
+}
 
-  // Launch the helper threads
-  for(i = 1; i < THREAD_MAX; i++)
-  {
-#if !defined(_MSC_VER)
-      pthread_create(pthread, NULL, init_thread, (void*)(&i));
-#else
-      DWORD iID[1];
-      CreateThread(NULL, 0, init_thread, (LPVOID)(&i), 0, iID);
+
+/// smp_stats() returns the statistics of the parallel search, those of the
+/// current search or, if 'total' is true, since program start. They are all
+/// zero unless the program has been compiled with -DSMP_STATS.
+
+SMPStats smp_stats(bool total) {
+
+  SMPStats s;
+  s.clear();
+
+#if defined(SMP_STATS)
+  if (total)
+      return SMPTotal;
+
+  for (int i = 0; i < ActiveThreads; i++)
+      s.add(thread_smp_stats(i));
 #endif
+  return s;
+}
 
-      // Wait until the thread has finished launching
-      while (!Threads[i].running);
-  }
+
+/// SMPStats::clear() resets all the counters
+
+void SMPStats::clear() {
+
+  memset(this, 0, sizeof(SMPStats));
 }
 
 
-/// stop_threads() is called when the program exits.  It makes all the
-/// helper threads exit cleanly.
+/// SMPStats::add() adds the counters of another SMPStats object
 
-void stop_threads() {
+void SMPStats::add(const SMPStats& s) {
 
-  ActiveThreads = THREAD_MAX;  // HACK
-  Idle = false;  // HACK
-  wake_sleeping_threads();
-  AllThreadsShouldExit = true;
-  for (int i = 1; i < THREAD_MAX; i++)
-  {
-      Threads[i].stop = true;
-      while(Threads[i].running);
-  }
-  destroy_split_point_stack();
+  const uint64_t* src = (const uint64_t*)&s;
+  uint64_t* dst = (uint64_t*)this;
+
+  for (size_t i = 0; i < sizeof(SMPStats) / sizeof(uint64_t); i++)
+      dst[i] += src[i];
+}
+
+
+/// SMPStats::print() writes the statistics in a human readable form, one
+/// item per line, each line starting with 'prefix'.
+
+void SMPStats::print(std::ostream& os, const std::string& prefix) const {
+
+  uint64_t tried = 0, done = 0, booked = 0;
+
+  for (int i = 0; i < Depths; i++)
+      tried += splitsTried[i], done += splitsDone[i];
+
+  for (int i = 0; i < Slaves; i++)
+      booked += i * slaves[i];
+
+  os.setf(std::ios::fixed);
+  os.precision(1);
+
+  os << prefix << "SMP splits tried " << tried
+     << " done " << done << " (" << (tried ? 100.0 * done / tried : 0) << "%)"
+     << " slaves per split " << (done ? double(booked) / done : 0) << std::endl;
+
+  os << prefix << "SMP splits by depth, tried/done:";
+  for (int i = 0; i < Depths; i++)
+      if (splitsTried[i])
+          os << " " << i << (i == Depths - 1 ? "+" : "") << ":"
+             << splitsTried[i] << "/" << splitsDone[i];
+  os << std::endl;
+
+  os << prefix << "SMP idle " << (threadNanos ? 100.0 * idleNanos / threadNanos : 0) << "%"
+     << " lock waits " << lockWaits
+     << " avg " << (lockWaits ? lockNanos / lockWaits : 0) << " ns" << std::endl;
+
+  os << prefix << "SMP cutoffs " << cutoffs
+     << " wasted nodes " << wastedNodes
+     << " (" << (nodes ? 100.0 * wastedNodes / nodes : 0) << "%)" << std::endl;
+}
+
+
+/// SMPStats::print_line() writes the statistics on a single line of
+/// key=value pairs, raw counters only, to be read by scripts. Histograms
+/// are lists of comma separated values.
+
+void SMPStats::print_line(std::ostream& os) const {
+
+  os << "smpstats nodes=" << nodes
+     << " thread_ns=" << threadNanos
+     << " idle_ns=" << idleNanos
+     << " lock_waits=" << lockWaits
+     << " lock_ns=" << lockNanos
+     << " cutoffs=" << cutoffs
+     << " wasted_nodes=" << wastedNodes;
+
+  os << " tried_by_depth=";
+  for (int i = 0; i < Depths; i++)
+      os << (i ? "," : "") << splitsTried[i];
+
+  os << " done_by_depth=";
+  for (int i = 0; i < Depths; i++)
+      os << (i ? "," : "") << splitsDone[i];
+
+  os << " slaves=";
+  for (int i = 0; i < Slaves; i++)
+      os << (i ? "," : "") << slaves[i];
+
+  os << std::endl;
 }
 
 
@@ -594,7 +782,7 @@ int64_t nodes_searched() {
 
   int64_t result = 0ULL;
   for (int i = 0; i < ActiveThreads; i++)
-      result += Threads[i].nodes;
+      result += Threads[i]->nodes;
   return result;
 }
 
@@ -625,14 +813,24 @@ namespace {
   Value id_loop(const Position& pos, Move searchMoves[]) {
 
     Position p(pos);
-    SearchStack ss[PLY_MAX_PLUS_2];
+    SearchStack* ss = Threads[0]->sstack;
 
     // searchMoves are verified, copied, scored and sorted
     RootMoveList rml(p, searchMoves);
 
     // Initialize
     TT.new_search();
+    // The follow-up tables are allocated only for the History objects in use
+    bool threadFollowUp = UseFollowUp && UseThreadHistory;
+    H.use_follow_up(UseFollowUp && !UseThreadHistory);
     H.clear();
+    HistoryBase.use_follow_up(threadFollowUp);
+    HistoryBase.clear();
+    for (int i = 0; i < ActiveThreads; i++)
+    {
+        Threads[i]->history.use_follow_up(threadFollowUp);
+        Threads[i]->history.clear();
+    }
     for (int i = 0; i < 3; i++)
     {
         ss[i].init(i);
@@ -641,6 +839,9 @@ namespace {
     IterationInfo[1] = IterationInfoType(rml.get_move_score(0), rml.get_move_score(0));
     Iteration = 1;
 
+    if (UseLazySMP && ActiveThreads > 1)
+        start_lazy_helpers(pos, searchMoves);
+
     EasyMove = rml.scan_for_easy_move();
 
     // Iterative deepening loop
@@ -684,6 +885,11 @@ namespace {
         if (AbortSearch)
             break; // Value cannot be trusted. Break out immediately!
 
+        // All the helpers are idle between two iterations, unless they
+        // search on their own in Lazy SMP mode.
+        if (UseThreadHistory && ActiveThreads > 1 && !UseLazySMP)
+            merge_histories();
+
         //Save info about search result
         Value speculatedValue;
         bool fHigh = false;
@@ -770,6 +976,9 @@ namespace {
             break;
     }
 
+    if (UseLazySMP && ActiveThreads > 1)
+        stop_lazy_helpers();
+
     rml.sort();
 
     // If we are pondering, we shouldn't print the best move before we
@@ -779,10 +988,12 @@ namespace {
     else
         // Print final search statistics
         std::cout << "info nodes " << nodes_searched()
-                  << " nps " << nps()
-                  << " time " << current_search_time()
+                  << time_and_nps()
                   << " hashfull " << TT.full() << std::endl;
 
+    TT.print_stats(std::cout, "info string ", false);
+    print_smp_stats(std::cout, "info string ");
+
     // Print the best move and the ponder move to the standard output
     if (ss[0].pv[0] == MOVE_NONE)
     {
@@ -804,6 +1015,8 @@ namespace {
             dbg_print_hit_rate(LogFile);
 
         StateInfo st;
+        TT.print_stats(LogFile, "", false);
+        print_smp_stats(LogFile, "");
         LogFile << "Nodes: " << nodes_searched() << std::endl
                 << "Nodes/second: " << nps() << std::endl
                 << "Best move: " << move_to_san(p, ss[0].pv[0]) << std::endl;
@@ -856,7 +1069,7 @@ namespace {
         // Pick the next root move, and print the move and the move number to
         // the standard output.
         move = ss[0].currentMove = rml.get_move(i);
-        if (current_search_time() >= 1000)
+        if (!Deterministic && current_search_time() >= 1000)
             std::cout << "info currmove " << move
                       << " currmovenumber " << i + 1 << std::endl;
 
@@ -938,22 +1151,7 @@ namespace {
                 if (i > 0)
                     BestMoveChangesByIteration[Iteration]++;
 
-                // Print search information to the standard output
-                std::cout << "info depth " << Iteration
-                          << " score " << value_to_string(value)
-                          << " time " << current_search_time()
-                          << " nodes " << nodes_searched()
-                          << " nps " << nps()
-                          << " pv ";
-
-                for (int j = 0; ss[0].pv[j] != MOVE_NONE && j < PLY_MAX; j++)
-                    std::cout << ss[0].pv[j] << " ";
-
-                std::cout << std::endl;
-
-                if (UseLogFile)
-                    LogFile << pretty_pv(pos, current_search_time(), Iteration, nodes_searched(), value, ss[0].pv)
-                            << std::endl;
+                print_pv_info(pos, ss, value);
 
                 if (value > alpha)
                     alpha = value;
@@ -972,9 +1170,8 @@ namespace {
                     std::cout << "info multipv " << j + 1
                               << " score " << value_to_string(rml.get_move_score(j))
                               << " depth " << ((j <= i)? Iteration : Iteration - 1)
-                              << " time " << current_search_time()
                               << " nodes " << nodes_searched()
-                              << " nps " << nps()
+                              << time_and_nps()
                               << " pv ";
 
                     for (k = 0; rml.get_move_pv(j, k) != MOVE_NONE && k < PLY_MAX; k++)
@@ -989,6 +1186,30 @@ namespace {
         assert(alpha >= oldAlpha);
 
         FailLow = (alpha == oldAlpha);
+
+        // With "Root Split" the moves after the first one are searched in
+        // parallel, see sp_search_root(). Not in MultiPV mode, where the
+        // moves are sorted after each one as they are searched.
+        Value bestValue = alpha;
+        int moves = i + 1;
+
+        if (   UseRootSplit
+            && ActiveThreads > 1
+            && !UseLazySMP
+            && MultiPV == 1
+            && moves < rml.move_count()
+            && alpha < beta
+            && idle_thread_exists(0)
+            && !AbortSearch)
+        {
+            RootMoves = &rml;
+            if (split(pos, ss, 0, &alpha, &beta, &bestValue, (Iteration - 2) * OnePly + InitialDepth,
+                      &moves, NULL, dcCandidates, 0, true))
+            {
+                FailLow = (alpha == oldAlpha);
+                break;
+            }
+        }
     }
     return alpha;
   }
@@ -1032,7 +1253,8 @@ namespace {
 
     // Transposition table lookup. At PV nodes, we don't use the TT for
     // pruning, but only for move ordering.
-    const TTEntry* tte = TT.retrieve(pos.get_key());
+    TTEntry ttEntry;
+    const TTEntry* tte = TT.retrieve(pos.get_key(), &ttEntry, threadID);
     Move ttMove = (tte ? tte->move() : MOVE_NONE);
 
     // Go with internal iterative deepening if we don't have a TT move
@@ -1044,7 +1266,7 @@ namespace {
 
     // Initialize a MovePicker object for the current position, and prepare
     // to search all moves
-    MovePicker mp = MovePicker(pos, ttMove, depth, H, &ss[ply]);
+    MovePicker mp = MovePicker(pos, ttMove, depth, thread_history(threadID), &ss[ply]);
 
     Move move, movesSearched[256];
     int moveCount = 0;
@@ -1107,13 +1329,14 @@ namespace {
                 // move at the root, set the flag failHighPly1. This is used for
                 // time managment:  We don't want to stop the search early in
                 // such cases, because resolving the fail high at ply 1 could
-                // result in a big drop in score at the root.
-                if (ply == 1 && RootMoveNumber == 1)
-                    Threads[threadID].failHighPly1 = true;
+                // result in a big drop in score at the root. The root is the
+                // one of thread 0, Lazy SMP helpers search their own.
+                if (ply == 1 && RootMoveNumber == 1 && threadID == 0)
+                    Threads[threadID]->failHighPly1 = true;
 
                 // A fail high occurred. Re-search at full window (pv search)
                 value = -search_pv(pos, ss, -beta, -alpha, newDepth, ply+1, threadID);
-                Threads[threadID].failHighPly1 = false;
+                Threads[threadID]->failHighPly1 = false;
           }
         }
       }
@@ -1136,6 +1359,7 @@ namespace {
           // ply 0, set the 'Problem' variable if the score has dropped a lot
           // (from the computer's point of view) since the previous iteration.
           if (   ply == 1
+              && threadID == 0
               && Iteration >= 2
               && -value <= IterationInfo[Iteration-1].value - ProblemMargin)
               Problem = true;
@@ -1143,6 +1367,7 @@ namespace {
 
       // Split?
       if (   ActiveThreads > 1
+          && !UseLazySMP
           && bestValue < beta
           && depth >= MinimumSplitDepth
           && Iteration <= 99
@@ -1165,7 +1390,7 @@ namespace {
         return bestValue;
 
     if (bestValue <= oldAlpha)
-        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_UPPER, depth, MOVE_NONE);
+        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_UPPER, depth, MOVE_NONE, threadID);
 
     else if (bestValue >= beta)
     {
@@ -1173,13 +1398,13 @@ namespace {
         Move m = ss[ply].pv[ply];
         if (ok_to_history(pos, m)) // Only non capture moves are considered
         {
-            update_history(pos, m, depth, movesSearched, moveCount);
+            update_history(pos, m, ss[ply - 1].currentMove, depth, movesSearched, moveCount, threadID);
             update_killers(m, ss[ply]);
         }
-        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_LOWER, depth, m);
+        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_LOWER, depth, m, threadID);
     }
     else
-        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_EXACT, depth, ss[ply].pv[ply]);
+        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_EXACT, depth, ss[ply].pv[ply], threadID);
 
     return bestValue;
   }
@@ -1220,8 +1445,12 @@ namespace {
     if (value_mate_in(ply + 1) < beta)
         return beta - 1;
 
+    // Start loading the pawn and material hash slots while we probe the TT
+    prefetch_eval_tables(pos, threadID);
+
     // Transposition table lookup
-    const TTEntry* tte = TT.retrieve(pos.get_key());
+    TTEntry ttEntry;
+    const TTEntry* tte = TT.retrieve(pos.get_key(), &ttEntry, threadID);
     Move ttMove = (tte ? tte->move() : MOVE_NONE);
 
     if (tte && ok_to_use_TT(tte, depth, beta, ply))
@@ -1305,7 +1534,7 @@ namespace {
 
     // Initialize a MovePicker object for the current position, and prepare
     // to search all moves.
-    MovePicker mp = MovePicker(pos, ttMove, depth, H, &ss[ply]);
+    MovePicker mp = MovePicker(pos, ttMove, depth, thread_history(threadID), &ss[ply]);
 
     Move move, movesSearched[256];
     int moveCount = 0;
@@ -1342,7 +1571,7 @@ namespace {
       {
           // History pruning. See ok_to_prune() definition
           if (   moveCount >= 2 + int(depth)
-              && ok_to_prune(pos, move, ss[ply].threatMove, depth))
+              && ok_to_prune(pos, move, ss[ply].threatMove, depth, threadID))
               continue;
 
           // Value based pruning
@@ -1403,6 +1632,7 @@ namespace {
 
       // Split?
       if (   ActiveThreads > 1
+          && !UseLazySMP
           && bestValue < beta
           && depth >= MinimumSplitDepth
           && Iteration <= 99
@@ -1425,17 +1655,17 @@ namespace {
         return bestValue;
 
     if (bestValue < beta)
-        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_UPPER, depth, MOVE_NONE);
+        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_UPPER, depth, MOVE_NONE, threadID);
     else
     {
         BetaCounter.add(pos.side_to_move(), depth, threadID);
         Move m = ss[ply].pv[ply];
         if (ok_to_history(pos, m)) // Only non capture moves are considered
         {
-            update_history(pos, m, depth, movesSearched, moveCount);
+            update_history(pos, m, ss[ply - 1].currentMove, depth, movesSearched, moveCount, threadID);
             update_killers(m, ss[ply]);
         }
-        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_LOWER, depth, m);
+        TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_LOWER, depth, m, threadID);
     }
 
     assert(bestValue > -VALUE_INFINITE && bestValue < VALUE_INFINITE);
@@ -1468,12 +1698,16 @@ namespace {
     if (pos.is_draw())
         return VALUE_DRAW;
 
+    // Start loading the pawn and material hash slots while we probe the TT
+    prefetch_eval_tables(pos, threadID);
+
     // Transposition table lookup, only when not in PV
-    TTEntry* tte = NULL;
+    TTEntry ttEntry;
+    const TTEntry* tte = NULL;
     bool pvNode = (beta - alpha != 1);
     if (!pvNode)
     {
-        tte = TT.retrieve(pos.get_key());
+        tte = TT.retrieve(pos.get_key(), &ttEntry, threadID);
         if (tte && ok_to_use_TT(tte, depth, beta, ply))
         {
             assert(tte->type() != VALUE_TYPE_EVAL);
@@ -1514,7 +1748,7 @@ namespace {
     {
         // Store the score to avoid a future costly evaluation() call
         if (!isCheck && !tte && ei.futilityMargin == 0)
-            TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_EVAL, Depth(-127*OnePly), MOVE_NONE);
+            TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_EVAL, Depth(-127*OnePly), MOVE_NONE, threadID);
 
         return bestValue;
     }
@@ -1525,7 +1759,7 @@ namespace {
     // Initialize a MovePicker object for the current position, and prepare
     // to search the moves.  Because the depth is <= 0 here, only captures,
     // queen promotions and checks (only if depth == 0) will be generated.
-    MovePicker mp = MovePicker(pos, ttMove, depth, H);
+    MovePicker mp = MovePicker(pos, ttMove, depth, thread_history(threadID));
     Move move;
     int moveCount = 0;
     Bitboard dcCandidates = mp.discovered_check_candidates();
@@ -1606,9 +1840,9 @@ namespace {
     {
         Depth d = (depth == Depth(0) ? Depth(0) : Depth(-1));
         if (bestValue < beta)
-            TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_UPPER, d, MOVE_NONE);
+            TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_UPPER, d, MOVE_NONE, threadID);
         else
-            TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_LOWER, d, m);
+            TT.store(pos.get_key(), value_to_tt(bestValue, ply), VALUE_TYPE_LOWER, d, m, threadID);
     }
 
     // Update killers only for good check moves
@@ -1633,25 +1867,23 @@ namespace {
     assert(ActiveThreads > 1);
 
     Position pos = Position(sp->pos);
-    SearchStack* ss = sp->sstack[threadID];
+    SearchStack* ss = Threads[threadID]->sstack;
     Value value;
     Move move;
+    int moveCount;
     bool isCheck = pos.is_check();
     bool useFutilityPruning =     sp->depth < SelectiveDepth
                               && !isCheck;
 
     while (    sp->bestValue < sp->beta
            && !thread_should_stop(threadID)
-           && (move = sp->mp->get_next_move(sp->lock)) != MOVE_NONE)
+           && (move = sp->next_move(&moveCount)) != MOVE_NONE)
     {
       assert(move_is_ok(move));
 
       bool moveIsCheck = pos.move_is_check(move, sp->dcCandidates);
       bool moveIsCapture = pos.move_is_capture(move);
-
-      lock_grab(&(sp->lock));
-      int moveCount = ++sp->moves;
-      lock_release(&(sp->lock));
+      SMP_STATS_DO(uint64_t nodes = Threads[threadID]->nodes);
 
       ss[sp->ply].currentMove = move;
 
@@ -1666,7 +1898,7 @@ namespace {
           && !moveIsCapture
           && !move_is_promotion(move)
           &&  moveCount >= 2 + int(sp->depth)
-          &&  ok_to_prune(pos, move, ss[sp->ply].threatMove, sp->depth))
+          &&  ok_to_prune(pos, move, ss[sp->ply].threatMove, sp->depth, threadID))
         continue;
 
       // Make and search the move.
@@ -1698,37 +1930,43 @@ namespace {
       assert(value > -VALUE_INFINITE && value < VALUE_INFINITE);
 
       if (thread_should_stop(threadID))
+      {
+          SMP_STATS_DO(if (!AbortSearch) Threads[threadID]->smpStats.wastedNodes += Threads[threadID]->nodes - nodes);
           break;
+      }
 
-      // New best move?
-      lock_grab(&(sp->lock));
-      if (value > sp->bestValue && !thread_should_stop(threadID))
+      // New best move? The PV is updated under the lock only if no other
+      // thread has raised bestValue further in the meantime.
+      if (   !thread_should_stop(threadID)
+          && raise_value(&sp->bestValue, value)
+          && value >= sp->beta)
       {
-          sp->bestValue = value;
-          if (sp->bestValue >= sp->beta)
+          grab_sp_lock(sp, threadID);
+          if (value == sp->bestValue)
           {
               sp_update_pv(sp->parentSstack, ss, sp->ply);
-              for (int i = 0; i < ActiveThreads; i++)
-                  if (i != threadID && (i == sp->master || sp->slaves[i]))
-                      Threads[i].stop = true;
+              for (int i = 0; i < sp->slots; i++)
+                  if (sp->threads[i] != threadID && (i == 0 || sp->slaves[i]))
+                      Threads[sp->threads[i]]->stop = true;
 
               sp->finished = true;
-        }
+              SMP_STATS_DO(Threads[threadID]->smpStats.cutoffs++);
+          }
+          lock_release(&(sp->lock));
       }
-      lock_release(&(sp->lock));
     }
 
-    lock_grab(&(sp->lock));
+    grab_sp_lock(sp, threadID);
 
     // If this is the master thread and we have been asked to stop because of
     // a beta cutoff higher up in the tree, stop all slave threads.
     if (sp->master == threadID && thread_should_stop(threadID))
-        for (int i = 0; i < ActiveThreads; i++)
+        for (int i = 1; i < sp->slots; i++)
             if (sp->slaves[i])
-                Threads[i].stop = true;
+                Threads[sp->threads[i]]->stop = true;
 
     sp->cpus--;
-    sp->slaves[threadID] = 0;
+    sp->slaves[sp->slot(threadID)] = 0;
 
     lock_release(&(sp->lock));
   }
@@ -1748,23 +1986,21 @@ namespace {
     assert(ActiveThreads > 1);
 
     Position pos = Position(sp->pos);
-    SearchStack* ss = sp->sstack[threadID];
+    SearchStack* ss = Threads[threadID]->sstack;
     Value value;
     Move move;
+    int moveCount;
 
     while (    sp->alpha < sp->beta
            && !thread_should_stop(threadID)
-           && (move = sp->mp->get_next_move(sp->lock)) != MOVE_NONE)
+           && (move = sp->next_move(&moveCount)) != MOVE_NONE)
     {
       bool moveIsCheck = pos.move_is_check(move, sp->dcCandidates);
       bool moveIsCapture = pos.move_is_capture(move);
+      SMP_STATS_DO(uint64_t nodes = Threads[threadID]->nodes);
 
       assert(move_is_ok(move));
 
-      lock_grab(&(sp->lock));
-      int moveCount = ++sp->moves;
-      lock_release(&(sp->lock));
-
       ss[sp->ply].currentMove = move;
 
       // Decide the new search depth.
@@ -1794,9 +2030,10 @@ namespace {
       if (value > sp->alpha) // Go with full depth non-pv search
       {
           ss[sp->ply].reduction = Depth(0);
-          value = -search(pos, ss, -sp->alpha, newDepth, sp->ply+1, true, threadID);
+          Value alpha = sp->alpha;
+          value = -search(pos, ss, -alpha, newDepth, sp->ply+1, true, threadID);
 
-          if (value > sp->alpha && value < sp->beta)
+          if (value > alpha && value < sp->beta)
           {
               // When the search fails high at ply 1 while searching the first
               // move at the root, set the flag failHighPly1.  This is used for
@@ -1804,10 +2041,10 @@ namespace {
               // such cases, because resolving the fail high at ply 1 could
               // result in a big drop in score at the root.
               if (sp->ply == 1 && RootMoveNumber == 1)
-                  Threads[threadID].failHighPly1 = true;
+                  Threads[threadID]->failHighPly1 = true;
 
-              value = -search_pv(pos, ss, -sp->beta, -sp->alpha, newDepth, sp->ply+1, threadID);
-              Threads[threadID].failHighPly1 = false;
+              value = -search_pv(pos, ss, -sp->beta, -alpha, newDepth, sp->ply+1, threadID);
+              Threads[threadID]->failHighPly1 = false;
         }
       }
       pos.undo_move(move);
@@ -1815,78 +2052,200 @@ namespace {
       assert(value > -VALUE_INFINITE && value < VALUE_INFINITE);
 
       if (thread_should_stop(threadID))
+      {
+          SMP_STATS_DO(if (!AbortSearch) Threads[threadID]->smpStats.wastedNodes += Threads[threadID]->nodes - nodes);
           break;
+      }
 
-      // New best move?
-      lock_grab(&(sp->lock));
-      if (value > sp->bestValue && !thread_should_stop(threadID))
+      // New best move? Alpha is raised without the lock, the PV is updated
+      // under the lock only if no other thread has raised alpha further in
+      // the meantime.
+      if (!thread_should_stop(threadID) && raise_value(&sp->bestValue, value))
       {
-          sp->bestValue = value;
-          if (value > sp->alpha)
+          if (raise_value(&sp->alpha, value))
           {
-              sp->alpha = value;
-              sp_update_pv(sp->parentSstack, ss, sp->ply);
               if (value == value_mate_in(sp->ply + 1))
                   ss[sp->ply].mateKiller = move;
 
-              if (value >= sp->beta)
+              grab_sp_lock(sp, threadID);
+              if (value == sp->alpha)
               {
-                  for (int i = 0; i < ActiveThreads; i++)
-                      if (i != threadID && (i == sp->master || sp->slaves[i]))
-                          Threads[i].stop = true;
+                  sp_update_pv(sp->parentSstack, ss, sp->ply);
+
+                  if (value >= sp->beta)
+                  {
+                      for (int i = 0; i < sp->slots; i++)
+                          if (sp->threads[i] != threadID && (i == 0 || sp->slaves[i]))
+                              Threads[sp->threads[i]]->stop = true;
 
-                  sp->finished = true;
+                      sp->finished = true;
+                      SMP_STATS_DO(Threads[threadID]->smpStats.cutoffs++);
+                  }
               }
-        }
-        // If we are at ply 1, and we are searching the first root move at
-        // ply 0, set the 'Problem' variable if the score has dropped a lot
-        // (from the computer's point of view) since the previous iteration.
-        if (   sp->ply == 1
-            && Iteration >= 2
-            && -value <= IterationInfo[Iteration-1].value - ProblemMargin)
-            Problem = true;
+              lock_release(&(sp->lock));
+          }
+          // If we are at ply 1, and we are searching the first root move at
+          // ply 0, set the 'Problem' variable if the score has dropped a lot
+          // (from the computer's point of view) since the previous iteration.
+          if (   sp->ply == 1
+              && Iteration >= 2
+              && -value <= IterationInfo[Iteration-1].value - ProblemMargin)
+              Problem = true;
       }
-      lock_release(&(sp->lock));
     }
 
-    lock_grab(&(sp->lock));
+    grab_sp_lock(sp, threadID);
 
     // If this is the master thread and we have been asked to stop because of
     // a beta cutoff higher up in the tree, stop all slave threads.
     if (sp->master == threadID && thread_should_stop(threadID))
-        for (int i = 0; i < ActiveThreads; i++)
+        for (int i = 1; i < sp->slots; i++)
             if (sp->slaves[i])
-                Threads[i].stop = true;
+                Threads[sp->threads[i]]->stop = true;
 
     sp->cpus--;
-    sp->slaves[threadID] = 0;
+    sp->slaves[sp->slot(threadID)] = 0;
 
     lock_release(&(sp->lock));
   }
 
-  /// The BetaCounterType class
 
-  BetaCounterType::BetaCounterType() { clear(); }
+  // sp_search_root() is used to search the root moves after the first one in
+  // parallel, when root_search() has split the root. Each thread picks root
+  // moves from the split point, searches them like root_search() does and
+  // then updates the root move list under the lock of the split point. The
+  // node count and the beta counters stored for a move are those of the
+  // thread which searched it, without the work of the threads it got help
+  // from below the root.
+
+  void sp_search_root(SplitPoint* sp, int threadID) {
+
+    assert(threadID >= 0 && threadID < ActiveThreads);
+    assert(ActiveThreads > 1);
+    assert(sp->ply == 0);
+
+    Position pos = Position(sp->pos);
+    SearchStack* ss = Threads[threadID]->sstack;
+    Color us = pos.side_to_move();
+    Value value;
+    Move move;
+    int moveCount;
+
+    while (    sp->alpha < sp->beta
+           && !AbortSearch
+           && !thread_should_stop(threadID)
+           && (move = sp->next_move(&moveCount)) != MOVE_NONE)
+    {
+      int64_t nodes = Threads[threadID]->nodes;
+      int64_t our = Threads[threadID]->betaCutOffs[us];
+      int64_t their = Threads[threadID]->betaCutOffs[opposite_color(us)];
+
+      RootMoveNumber = moveCount;
+      ss[0].currentMove = move;
+      if (!Deterministic && current_search_time() >= 1000)
+      {
+          lock_grab(&IOLock);
+          std::cout << "info currmove " << move
+                    << " currmovenumber " << moveCount << std::endl;
+          lock_release(&IOLock);
+      }
+
+      // Decide the new search depth.
+      bool dangerous;
+      Depth ext = extension(pos, move, true, pos.move_is_capture(move), pos.move_is_check(move), false, false, &dangerous);
+      Depth newDepth = sp->depth + ext;
+
+      // Make and search the move. FailHigh stays set until the end of the
+      // iteration, as another thread could be resolving a fail high too.
+      StateInfo st;
+      pos.do_move(move, st, sp->dcCandidates);
+
+      // Another thread can raise sp->alpha at any time, up to a fail high,
+      // so the window is taken once and the re-search is skipped if it is
+      // already empty.
+      Value alpha = sp->alpha;
+      value = -search(pos, ss, -alpha, newDepth, 1, true, threadID);
+      if (value > alpha && alpha < sp->beta)
+      {
+          FailHigh = true;
+          value = -search_pv(pos, ss, -sp->beta, -alpha, newDepth, 1, threadID);
+      }
+      pos.undo_move(move);
+
+      assert(value > -VALUE_INFINITE && value < VALUE_INFINITE);
+
+      if (AbortSearch || thread_should_stop(threadID))
+      {
+          SMP_STATS_DO(if (!AbortSearch) Threads[threadID]->smpStats.wastedNodes += Threads[threadID]->nodes - nodes);
+          break;
+      }
+
+      grab_sp_lock(sp, threadID);
+
+      int i = moveCount - 1;
+      RootMoves->set_move_nodes(i, Threads[threadID]->nodes - nodes);
+      RootMoves->set_beta_counters(i, Threads[threadID]->betaCutOffs[us] - our,
+                                      Threads[threadID]->betaCutOffs[opposite_color(us)] - their);
+
+      if (value <= sp->alpha)
+          RootMoves->set_move_score(i, -VALUE_INFINITE);
+      else
+      {
+          // New best move!
+          sp->alpha = sp->bestValue = value;
+          sp_update_pv(sp->parentSstack, ss, 0);
+          RootMoves->set_move_score(i, value);
+          RootMoves->set_move_pv(i, ss[0].pv);
+          BestMoveChangesByIteration[Iteration]++;
+
+          print_pv_info(pos, ss, value);
+
+          if (value > IterationInfo[Iteration - 1].value - NoProblemMargin)
+              Problem = false;
+
+          if (value >= sp->beta)
+          {
+              for (int j = 0; j < sp->slots; j++)
+                  if (sp->threads[j] != threadID && (j == 0 || sp->slaves[j]))
+                      Threads[sp->threads[j]]->stop = true;
+
+              sp->finished = true;
+              SMP_STATS_DO(Threads[threadID]->smpStats.cutoffs++);
+          }
+      }
+      lock_release(&(sp->lock));
+    }
+
+    grab_sp_lock(sp, threadID);
+
+    sp->cpus--;
+    sp->slaves[sp->slot(threadID)] = 0;
+
+    lock_release(&(sp->lock));
+  }
+
+
+  /// The BetaCounterType class
 
   void BetaCounterType::clear() {
 
-    for (int i = 0; i < THREAD_MAX; i++)
-        Threads[i].betaCutOffs[WHITE] = Threads[i].betaCutOffs[BLACK] = 0ULL;
+    for (int i = 0; i < ActiveThreads; i++)
+        Threads[i]->betaCutOffs[WHITE] = Threads[i]->betaCutOffs[BLACK] = 0ULL;
   }
 
   void BetaCounterType::add(Color us, Depth d, int threadID) {
 
     // Weighted count based on depth
-    Threads[threadID].betaCutOffs[us] += unsigned(d);
+    Threads[threadID]->betaCutOffs[us] += unsigned(d);
   }
 
   void BetaCounterType::read(Color us, int64_t& our, int64_t& their) {
 
     our = their = 0UL;
-    for (int i = 0; i < THREAD_MAX; i++)
+    for (int i = 0; i < ActiveThreads; i++)
     {
-        our += Threads[i].betaCutOffs[us];
-        their += Threads[i].betaCutOffs[opposite_color(us)];
+        our += Threads[i]->betaCutOffs[us];
+        their += Threads[i]->betaCutOffs[opposite_color(us)];
     }
   }
 
@@ -2046,20 +2405,37 @@ namespace {
   // init_node() is called at the beginning of all the search functions
   // (search(), search_pv(), qsearch(), and so on) and initializes the search
   // stack object corresponding to the current node.  Once every
-  // NodesBetweenPolls nodes, init_node() also calls poll(), which polls
-  // for user input and checks whether it is time to stop the search.
+  // NodesBetweenPolls nodes, and at once when the input thread has queued
+  // a command unless the search is deterministic, init_node() also calls
+  // poll(), which reads the commands and checks whether it is time to stop
+  // the search.
+  //
+  // With a node limit, the search stops as soon as the nodes flushed to the
+  // shared counter plus those of the thread not flushed yet reach it. The
+  // other threads may each have up to NodesBatch nodes not flushed yet, with
+  // one thread the count is exact.
 
   void init_node(SearchStack ss[], int ply, int threadID) {
 
     assert(ply >= 0 && ply < PLY_MAX);
     assert(threadID >= 0 && threadID < ActiveThreads);
 
-    Threads[threadID].nodes++;
+    uint64_t nodes = ++Threads[threadID]->nodes;
+
+    if (MaxNodes)
+    {
+        int64_t pending = int64_t(nodes % NodesBatch);
+        if (!pending)
+            atomic_fetch_add_int64(&NodesFlushed.value, NodesBatch);
+
+        if (NodesFlushed.value + pending >= MaxNodes)
+            AbortSearch = true;
+    }
 
     if (threadID == 0)
     {
         NodesSincePoll++;
-        if (NodesSincePoll >= NodesBetweenPolls)
+        if (NodesSincePoll >= NodesBetweenPolls || (InputPending && !Deterministic))
         {
             poll();
             NodesSincePoll = 0;
@@ -2068,7 +2444,7 @@ namespace {
     ss[ply].init(ply);
     ss[ply+2].initKillers();
 
-    if (Threads[threadID].printCurrentLine)
+    if (Threads[threadID]->printCurrentLine)
         print_current_line(ss, ply, threadID);
   }
 
@@ -2275,7 +2651,7 @@ namespace {
   // non-tactical moves late in the move list close to the leaves are
   // candidates for pruning.
 
-  bool ok_to_prune(const Position& pos, Move m, Move threat, Depth d) {
+  bool ok_to_prune(const Position& pos, Move m, Move threat, Depth d, int threadID) {
 
     assert(move_is_ok(m));
     assert(threat == MOVE_NONE || move_is_ok(threat));
@@ -2311,7 +2687,7 @@ namespace {
         return false;
 
     // Case 4: Don't prune moves with good history
-    if (!H.ok_to_prune(pos.piece_on(mfrom), mto, d))
+    if (!thread_history(threadID).ok_to_prune(pos.piece_on(mfrom), mto, d))
         return false;
 
     // Case 5: If the moving piece in the threatened move is a slider, don't
@@ -2353,22 +2729,67 @@ namespace {
 
 
   // update_history() registers a good move that produced a beta-cutoff
-  // in history and marks as failures all the other moves of that ply.
+  // in history and marks as failures all the other moves of that ply. With
+  // "Countermove History" the move also becomes the countermove of the
+  // previous move 'prevMove', and scores in the follow-up history, unless
+  // the previous move is null or its destination square is empty (castling).
+
+  void update_history(const Position& pos, Move m, Move prevMove, Depth depth,
+                      Move movesSearched[], int moveCount, int threadID) {
+
+    History& h = thread_history(threadID);
+    Piece piece = pos.piece_on(move_from(m));
 
-  void update_history(const Position& pos, Move m, Depth depth,
-                      Move movesSearched[], int moveCount) {
+    h.success(piece, move_to(m), depth);
 
-    H.success(pos.piece_on(move_from(m)), move_to(m), depth);
+    if (move_is_ok(prevMove) && h.follow_up_in_use())
+    {
+        Square prevTo = move_to(prevMove);
+        Piece prevPiece = pos.piece_on(prevTo);
+
+        if (piece_is_ok(prevPiece))
+            h.success_after(prevPiece, prevTo, piece, move_to(m), m, depth);
+    }
 
     for (int i = 0; i < moveCount - 1; i++)
     {
         assert(m != movesSearched[i]);
         if (ok_to_history(pos, movesSearched[i]))
-            H.failure(pos.piece_on(move_from(movesSearched[i])), move_to(movesSearched[i]));
+            h.failure(pos.piece_on(move_from(movesSearched[i])), move_to(movesSearched[i]));
     }
   }
 
 
+  // thread_history() returns the history table a thread must use: its own
+  // with "Thread History", otherwise the one shared by all the threads. The
+  // shared table is updated without locking, so with many threads its cache
+  // lines keep moving between the cores.
+
+  History& thread_history(int threadID) {
+
+    return UseThreadHistory ? Threads[threadID]->history : H;
+  }
+
+
+  // merge_histories() is called between two iterations with "Thread History".
+  // What the other threads have learnt during the iteration, that is their
+  // table minus HistoryBase, is added to the table of the main thread, which
+  // is then copied to the others and becomes the new base. So each thread
+  // starts the next iteration knowing what all of them have learnt, and the
+  // counts grow as in a search with a single table.
+
+  void merge_histories() {
+
+    for (int i = 1; i < ActiveThreads; i++)
+        Threads[0]->history.merge(Threads[i]->history, HistoryBase);
+
+    for (int i = 1; i < ActiveThreads; i++)
+        Threads[i]->history = Threads[0]->history;
+
+    HistoryBase = Threads[0]->history;
+  }
+
+
   // update_killers() add a good move that produced a beta-cutoff
   // among the killer moves of that ply.
 
@@ -2390,7 +2811,7 @@ namespace {
   bool fail_high_ply_1() {
 
     for(int i = 0; i < ActiveThreads; i++)
-        if (Threads[i].failHighPly1)
+        if (Threads[i]->failHighPly1)
             return true;
 
     return false;
@@ -2405,6 +2826,20 @@ namespace {
   }
 
 
+  // time_and_nps() returns the time and nodes/second fields of the info
+  // lines, or an empty string with "Deterministic".
+
+  std::string time_and_nps() {
+
+    if (Deterministic)
+        return "";
+
+    std::ostringstream ss;
+    ss << " time " << current_search_time() << " nps " << nps();
+    return ss.str();
+  }
+
+
   // nps() computes the current nodes/second count.
 
   int nps() {
@@ -2422,13 +2857,14 @@ namespace {
     static int lastInfoTime;
     int t = current_search_time();
 
-    //  Poll for input
-    if (Bioskey())
+    // Read the commands queued by the input thread. "isready" is answered at
+    // once. We stop reading after "stop", "quit" and "ponderhit", what comes
+    // next is left in the queue for uci_main_loop() or for the next poll().
+    // Other commands are not allowed during the search and are dropped.
+    InputPending = false;
+    while (!AbortSearch && input_available())
     {
-        // We are line oriented, don't read single chars
-        std::string command;
-        if (!std::getline(std::cin, command))
-            command = "quit";
+        std::string command = read_input();
 
         if (command == "quit")
         {
@@ -2441,11 +2877,26 @@ namespace {
         {
             AbortSearch = true;
             PonderSearch = false;
+            return;
         }
         else if (command == "ponderhit")
+        {
             ponderhit();
+            InputPending = input_available();
+            break;
+        }
+        else if (command == "isready")
+        {
+            lock_grab(&IOLock);
+            std::cout << "readyok" << std::endl;
+            lock_release(&IOLock);
+        }
     }
-    // Print search information
+    // Print search information, nothing with "Deterministic" as the
+    // search does not stop on time either
+    if (Deterministic)
+        return;
+
     if (t < 1000)
         lastInfoTime = 0;
 
@@ -2468,7 +2919,7 @@ namespace {
                   << " time " << t << " hashfull " << TT.full() << std::endl;
         lock_release(&IOLock);
         if (ShowCurrentLine)
-            Threads[0].printCurrentLine = true;
+            Threads[0]->printCurrentLine = true;
     }
     // Should we stop the search?
     if (PonderSearch)
@@ -2480,8 +2931,7 @@ namespace {
                          && t > 6*(MaxSearchTime + ExtraSearchTime));
 
     if (   (Iteration >= 3 && (!InfiniteSearch && overTime))
-        || (ExactMaxTime && t >= ExactMaxTime)
-        || (Iteration >= 3 && MaxNodes && nodes_searched() >= MaxNodes))
+        || (ExactMaxTime && t >= ExactMaxTime))
         AbortSearch = true;
   }
 
@@ -2505,27 +2955,64 @@ namespace {
   }
 
 
+  // print_pv_info() prints the score and the PV in ss[0] of a new best move
+  // at the root to the standard output, and to the log file if it is in use.
+  // With "Root Split" it is called by the helper threads too, so it prints
+  // under IOLock.
+
+  void print_pv_info(const Position& pos, SearchStack ss[], Value value) {
+
+    lock_grab(&IOLock);
+
+    std::cout << "info depth " << Iteration
+              << " score " << value_to_string(value)
+              << " nodes " << nodes_searched()
+              << time_and_nps()
+              << " pv ";
+
+    for (int j = 0; ss[0].pv[j] != MOVE_NONE && j < PLY_MAX; j++)
+        std::cout << ss[0].pv[j] << " ";
+
+    std::cout << std::endl;
+
+    if (UseLogFile)
+        LogFile << pretty_pv(pos, current_search_time(), Iteration, nodes_searched(), value, ss[0].pv)
+                << std::endl;
+
+    lock_release(&IOLock);
+  }
+
+
   // print_current_line() prints the current line of search for a given
-  // thread.  Called when the UCI option UCI_ShowCurrLine is 'true'.
+  // thread.  Called when the UCI option UCI_ShowCurrLine is 'true'. A
+  // thread searching for a split point has made the moves below the split
+  // ply on the stack of the master, so they are read from there, going up
+  // the chain of split points.
 
   void print_current_line(SearchStack ss[], int ply, int threadID) {
 
     assert(ply >= 0 && ply < PLY_MAX);
     assert(threadID >= 0 && threadID < ActiveThreads);
 
-    if (!Threads[threadID].idle)
+    if (!Threads[threadID]->idle)
     {
         lock_grab(&IOLock);
         std::cout << "info currline " << (threadID + 1);
         for (int p = 0; p < ply; p++)
-            std::cout << " " << ss[p].currentMove;
+        {
+            const SearchStack* sstck = ss;
+            for (SplitPoint* sp = Threads[threadID]->splitPoint; sp && p < sp->ply; sp = sp->parent)
+                sstck = sp->parentSstack;
+
+            std::cout << " " << sstck[p].currentMove;
+        }
 
         std::cout << std::endl;
         lock_release(&IOLock);
     }
-    Threads[threadID].printCurrentLine = false;
+    Threads[threadID]->printCurrentLine = false;
     if (threadID + 1 < ActiveThreads)
-        Threads[threadID + 1].printCurrentLine = true;
+        Threads[threadID + 1]->printCurrentLine = true;
   }
 
 
@@ -2542,8 +3029,7 @@ namespace {
 
     while (true)
     {
-        if (!std::getline(std::cin, command))
-            command = "quit";
+        command = read_input();
 
         if (command == "quit")
         {
@@ -2559,68 +3045,285 @@ namespace {
   // idle_loop() is where the threads are parked when they have no work to do.
   // The parameter "waitSp", if non-NULL, is a pointer to an active SplitPoint
   // object for which the current thread is the master.
+  //
+  // A helper thread with nothing to do spins for a while, as during a search
+  // new work usually comes soon, and then sleeps until split() books it and
+  // wakes it up. The spin time adapts: it doubles when work arrives while
+  // spinning and halves when the thread had to sleep anyway during a search.
+  // With "Late Join" the helpers do not sleep during a search, they keep
+  // looking for split points to join. A master waits for its slaves by
+  // spinning only, the wait is short.
 
   void idle_loop(int threadID, SplitPoint* waitSp) {
-    assert(threadID >= 0 && threadID < THREAD_MAX);
+    assert(threadID >= 0 && threadID < ActiveThreads);
 
-    Threads[threadID].running = true;
+    Threads[threadID]->running = true;
+
+    int64_t idleStart = get_system_nanos();
+    int64_t lastPoll = idleStart;
+    bool slept = false;
 
     while(true) {
       if(AllThreadsShouldExit && threadID != 0)
         break;
 
-      // If we are not thinking, wait for a condition to be signaled instead
-      // of wasting CPU time polling for work:
-      while(threadID != 0 && (Idle || threadID >= ActiveThreads)) {
-#if !defined(_MSC_VER)
-        pthread_mutex_lock(&WaitLock);
-        if(Idle || threadID >= ActiveThreads)
-          pthread_cond_wait(&WaitCond, &WaitLock);
-        pthread_mutex_unlock(&WaitLock);
-#else
-        WaitForSingleObject(SitIdleEvent[threadID], INFINITE);
-#endif
+      if(   waitSp == NULL
+         && !slept
+         && !Threads[threadID]->workIsWaiting
+         && !(UseLateJoin && !Idle)
+         && get_system_nanos() - idleStart > Threads[threadID]->spinNanos) {
+        // Sleeping between two searches says nothing on the spin time
+        if(!Idle)
+          Threads[threadID]->spinNanos = Max(Threads[threadID]->spinNanos / 2, MinSpinNanos);
+
+        sleep_until_woken(threadID);
+
+        // Woken without work when a search with "Late Join" starts
+        if(!Threads[threadID]->workIsWaiting)
+          idleStart = get_system_nanos();
+        else
+          slept = true;
+        continue;
       }
 
+      // Move to our NUMA node and CPU if think() has changed them
+      bind_thread(threadID);
+
+      // With "Late Join" an idle thread does not wait to be booked by
+      // split(), it looks for a split point to help by itself.
+      if(   UseLateJoin
+         && !Idle
+         && !Threads[threadID]->workIsWaiting
+         && (waitSp == NULL || waitSp->cpus > 0))
+        late_join(threadID);
+
       // If this thread has been assigned work, launch a search
-      if(Threads[threadID].workIsWaiting) {
-        Threads[threadID].workIsWaiting = false;
-        if(Threads[threadID].splitPoint->pvNode)
-          sp_search_pv(Threads[threadID].splitPoint, threadID);
+      if(Threads[threadID]->workIsWaiting) {
+        int64_t start = get_system_nanos();
+
+        if(waitSp != NULL)
+          Threads[threadID]->idleNanos += start - idleStart;
+        else if(!slept)
+          Threads[threadID]->spinNanos = Min(Threads[threadID]->spinNanos * 2, MaxSpinNanos);
+
+        if(Threads[threadID]->bookedAt) {
+          Threads[threadID]->wakeups++;
+          Threads[threadID]->wakeNanos += start - Threads[threadID]->bookedAt;
+          Threads[threadID]->bookedAt = 0;
+        }
+
+        Threads[threadID]->workIsWaiting = false;
+        if(Threads[threadID]->splitPoint == NULL)
+          lazy_search(threadID);
+        else if(Threads[threadID]->splitPoint->ply == 0)
+          sp_search_root(Threads[threadID]->splitPoint, threadID);
+        else if(Threads[threadID]->splitPoint->pvNode)
+          sp_search_pv(Threads[threadID]->splitPoint, threadID);
         else
-          sp_search(Threads[threadID].splitPoint, threadID);
-        Threads[threadID].idle = true;
+          sp_search(Threads[threadID]->splitPoint, threadID);
+        Threads[threadID]->idle = true;
+
+        idleStart = get_system_nanos();
+        slept = false;
+        if(waitSp == NULL)
+          Threads[threadID]->busyNanos += idleStart - start;
+      }
+
+      // The main thread waiting at the root keeps polling for input and for
+      // the time limits, a root split point can last long.
+      if(   threadID == 0
+         && waitSp != NULL
+         && waitSp->ply == 0
+         && get_system_nanos() - lastPoll > 1000000) {
+        poll();
+        lastPoll = get_system_nanos();
       }
 
       // If this thread is the master of a split point and all threads have
       // finished their work at this split point, return from the idle loop.
-      if(waitSp != NULL && waitSp->cpus == 0)
+      if(waitSp != NULL && waitSp->cpus == 0) {
+        Threads[threadID]->idleNanos += get_system_nanos() - idleStart;
         return;
+      }
+    }
+
+    Threads[threadID]->running = false;
+  }
+
+
+  // create_threads() allocates the data of n threads, sized for n, and
+  // launches the n - 1 helper threads. Each Thread object and split point
+  // stack lives in its own pages, so that it can be moved to the NUMA node
+  // of its thread.
+
+  void create_threads(int n) {
+    assert(n >= 1 && n <= THREAD_MAX);
+
+    volatile int i;
+
+#if !defined(_MSC_VER)
+    pthread_t pthread[1];
+#else
+    DWORD iID[1];
+#endif
+
+    ActiveThreads = n;
+    Threads = new Thread*[n];
+    SplitPointStack = new SplitPoint*[n];
+
+    for(i = 0; i < n; i++) {
+      Threads[i] = (Thread*)page_alloc(sizeof(Thread));
+      if(!Threads[i]) {
+        std::cerr << "Failed to allocate thread data" << std::endl;
+        Application::exit_with_failure();
+      }
+      new (Threads[i]) Thread(); // Zeroed, and the history cleared
+      Threads[i]->numaNode = Threads[i]->boundNode = -1;
+      Threads[i]->cpu = Threads[i]->boundCpu = -1;
+      Threads[i]->spinNanos = MaxSpinNanos / 8;
+#if !defined(_MSC_VER)
+      pthread_mutex_init(&(Threads[i]->sleepLock), NULL);
+      pthread_cond_init(&(Threads[i]->sleepCond), NULL);
+#else
+      Threads[i]->sleepEvent = CreateEvent(0, FALSE, FALSE, 0);
+#endif
+    }
+
+    init_split_point_stack();
+
+    // All threads except the main thread should be initialized to idle state
+    for(i = 1; i < n; i++)
+      Threads[i]->idle = true;
+
+    // Launch the helper threads. They are never joined, destroy_threads()
+    // waits for them to leave idle_loop() instead.
+    for(i = 1; i < n; i++) {
+#if !defined(_MSC_VER)
+      if(!pthread_create(pthread, NULL, init_thread, (void*)(&i)))
+        pthread_detach(pthread[0]);
+#else
+      CloseHandle(CreateThread(NULL, 0, init_thread, (LPVOID)(&i), 0, iID));
+#endif
+
+      // Wait until the thread has finished launching
+      while(!Threads[i]->running);
+    }
+  }
+
+
+  // destroy_threads() makes all the helper threads exit cleanly, and frees
+  // the data of all the threads. Called when the program exits, and by
+  // think() before to create a pool of a different size.
+
+  void destroy_threads() {
+
+    AllThreadsShouldExit = true;
+    wake_sleeping_threads();
+    for(int i = 1; i < ActiveThreads; i++) {
+      Threads[i]->stop = true;
+      while(Threads[i]->running);
+    }
+    AllThreadsShouldExit = false;
+
+    destroy_split_point_stack();
+
+    for(int i = 0; i < ActiveThreads; i++) {
+#if !defined(_MSC_VER)
+      pthread_mutex_destroy(&(Threads[i]->sleepLock));
+      pthread_cond_destroy(&(Threads[i]->sleepCond));
+#else
+      CloseHandle(Threads[i]->sleepEvent);
+#endif
+      Threads[i]->~Thread();
+      page_free(Threads[i], sizeof(Thread));
     }
 
-    Threads[threadID].running = false;
+    delete [] Threads;
+    delete [] SplitPointStack;
+    ActiveThreads = 0;
   }
 
 
-  // init_split_point_stack() is called during program initialization, and
-  // initializes all split point objects.
+  // init_split_point_stack() is called by create_threads(), and initializes
+  // the split point objects of all the threads.
 
   void init_split_point_stack() {
-    for(int i = 0; i < THREAD_MAX; i++)
+    for(int i = 0; i < ActiveThreads; i++) {
+      SplitPointStack[i] = (SplitPoint*)page_alloc(MaxActiveSplitPoints * sizeof(SplitPoint));
+      if(!SplitPointStack[i]) {
+        std::cerr << "Failed to allocate split point stack" << std::endl;
+        Application::exit_with_failure();
+      }
       for(int j = 0; j < MaxActiveSplitPoints; j++) {
+        new (SplitPointStack[i] + j) SplitPoint();
         SplitPointStack[i][j].parent = NULL;
         lock_init(&(SplitPointStack[i][j].lock), NULL);
       }
+    }
   }
 
 
-  // destroy_split_point_stack() is called when the program exits, and
-  // destroys all locks in the precomputed split point objects.
+  // destroy_split_point_stack() is called by destroy_threads(), and destroys
+  // all locks in the precomputed split point objects.
 
   void destroy_split_point_stack() {
-    for(int i = 0; i < THREAD_MAX; i++)
+    for(int i = 0; i < ActiveThreads; i++) {
       for(int j = 0; j < MaxActiveSplitPoints; j++)
         lock_destroy(&(SplitPointStack[i][j].lock));
+
+      page_free(SplitPointStack[i], MaxActiveSplitPoints * sizeof(SplitPoint));
+    }
+  }
+
+
+  // place_threads() is called by think() when the number of threads or the
+  // "NUMA" or "Thread Affinity" options change. With NUMA on, threads are
+  // assigned to the nodes round robin, and the Thread object, the split
+  // point stack and the pawn and material hash tables of each thread are
+  // moved to its node. With Thread Affinity on, the n-th thread is pinned to
+  // the CPU given by logical_cpu(n), one per physical core first, and with
+  // NUMA on too its node is the one of that CPU. The helper threads bind
+  // themselves in idle_loop(). With both off, everything goes back to the
+  // default policy of the system.
+
+  void place_threads() {
+    int nodes = node_count();
+
+    for(int i = 0; i < ActiveThreads; i++) {
+      int cpu = (UseAffinity ? logical_cpu(i) : -1);
+      int node = (UseNUMA ? i % nodes : -1);
+
+      if(UseNUMA && cpu >= 0 && cpu_node(cpu) >= 0)
+        node = cpu_node(cpu);
+
+      bind_memory_to_node(Threads[i], sizeof(Thread), node);
+      bind_memory_to_node(SplitPointStack[i], MaxActiveSplitPoints * sizeof(SplitPoint), node);
+      bind_eval_tables(i, node);
+      Threads[i]->numaNode = node;
+      Threads[i]->cpu = cpu;
+    }
+    bind_thread(0);
+  }
+
+
+  // bind_thread() moves the calling thread to the NUMA node and the CPU that
+  // place_threads() has assigned to it, if they have changed. Binding to a
+  // node resets the CPUs the thread may run on, so the CPU comes after.
+
+  void bind_thread(int threadID) {
+    Thread* t = Threads[threadID];
+
+    if(t->boundNode == t->numaNode && t->boundCpu == t->cpu)
+      return;
+
+    bind_thread_to_node(t->numaNode);
+    if(t->cpu >= 0)
+      bind_thread_to_cpu(t->cpu);
+    else if(t->boundCpu >= 0 && t->numaNode < 0)
+      bind_thread_to_cpu(-1);
+
+    t->boundNode = t->numaNode;
+    t->boundCpu = t->cpu;
   }
 
 
@@ -2634,19 +3337,35 @@ namespace {
 
     SplitPoint* sp;
 
-    if(Threads[threadID].stop)
+    if(Threads[threadID]->stop)
       return true;
     if(ActiveThreads <= 2)
       return false;
-    for(sp = Threads[threadID].splitPoint; sp != NULL; sp = sp->parent)
+    for(sp = Threads[threadID]->splitPoint; sp != NULL; sp = sp->parent)
       if(sp->finished) {
-        Threads[threadID].stop = true;
+        Threads[threadID]->stop = true;
         return true;
       }
     return false;
   }
 
 
+  // raise_value() sets the shared value "v" to "value" if this is bigger,
+  // with a compare and swap loop so that no lock is needed. Returns false if
+  // "v" was already at least as big.
+
+  bool raise_value(volatile Value* v, Value value) {
+
+    Value old;
+
+    while((old = *v) < value)
+      if(atomic_cas_int((volatile int*)v, old, value))
+        return true;
+
+    return false;
+  }
+
+
   // thread_is_available() checks whether the thread with threadID "slave" is
   // available to help the thread with threadID "master" at a split point.  An
   // obvious requirement is that "slave" must be idle.  With more than two
@@ -2660,10 +3379,10 @@ namespace {
     assert(master >= 0 && master < ActiveThreads);
     assert(ActiveThreads > 1);
 
-    if(!Threads[slave].idle || slave == master)
+    if(!Threads[slave]->idle || slave == master)
       return false;
 
-    if(Threads[slave].activeSplitPoints == 0)
+    if(Threads[slave]->activeSplitPoints == 0)
       // No active split points means that the thread is available as a slave
       // for any other thread.
       return true;
@@ -2672,7 +3391,7 @@ namespace {
       return true;
 
     // Apply the "helpful master" concept if possible.
-    if(SplitPointStack[slave][Threads[slave].activeSplitPoints-1].slaves[master])
+    if(SplitPointStack[slave][Threads[slave]->activeSplitPoints-1].is_slave(master))
       return true;
 
     return false;
@@ -2693,6 +3412,204 @@ namespace {
   }
 
 
+  // can_join() checks whether the thread with threadID can join the split
+  // point "sp" as a late slave. The split point must still have moves to
+  // search and a free slot. If the thread is waiting as the master of a
+  // split point, it may only join the descendants of that split point (the
+  // "helpful master" concept again), otherwise it would overwrite the plies
+  // of its search stack that are still in use. The lock-free scan of
+  // late_join() calls it to pick a candidate, the answer is final only
+  // with MPLock and the lock of the split point held.
+
+  bool can_join(const SplitPoint* sp, int threadID) {
+
+    if(   sp->finished
+       || sp->cpus == 0
+       || sp->slots >= MaxThreadsPerSplitPoint
+       || sp->depth < MinimumSplitDepth
+       || sp->no_more_moves())
+      return false;
+
+    if(Threads[threadID]->activeSplitPoints == 0)
+      return true;
+
+    const SplitPoint* top = SplitPointStack[threadID] + Threads[threadID]->activeSplitPoints - 1;
+
+    for(const SplitPoint* p = sp->parent; p != NULL; p = p->parent)
+      if(p == top)
+        return true;
+
+    return false;
+  }
+
+
+  // late_join() is called by an idle thread when "Late Join" is on. A first
+  // scan without locks picks, among the split points the thread may join,
+  // the one with the biggest remaining depth. It is then checked again and
+  // joined under the locks, as if split() had booked the thread there: the
+  // thread gets the split ply of the master's stack as it was at the split,
+  // since the master has searched on from there.
+
+  void late_join(int threadID) {
+    assert(threadID >= 0 && threadID < ActiveThreads);
+
+    SplitPoint* sp = NULL;
+
+    for(int i = 0; i < ActiveThreads; i++)
+      for(int j = 0; j < Threads[i]->activeSplitPoints; j++) {
+        SplitPoint* s = SplitPointStack[i] + j;
+        if(   (sp == NULL || s->depth > sp->depth)
+           && can_join(s, threadID))
+          sp = s;
+      }
+
+    if(sp == NULL)
+      return;
+
+    lock_grab(&MPLock);
+    grab_sp_lock(sp, threadID);
+
+    // The split point is still in use only if it is on the stack of its master
+    if(   Threads[threadID]->idle
+       && !Threads[threadID]->workIsWaiting
+       && sp - SplitPointStack[sp->master] < Threads[sp->master]->activeSplitPoints
+       && can_join(sp, threadID)) {
+      int s = sp->slots++;
+      Threads[threadID]->sstack[sp->ply] = sp->splitSs;
+      sp->threads[s] = threadID;
+      sp->slaves[s] = 1;
+      sp->cpus++;
+      Threads[threadID]->splitPoint = sp;
+      Threads[threadID]->lateJoins++;
+      Threads[threadID]->stop = false;
+      Threads[threadID]->idle = false;
+      Threads[threadID]->workIsWaiting = true;
+    }
+
+    lock_release(&(sp->lock));
+    lock_release(&MPLock);
+  }
+
+
+  // start_lazy_helpers() is called by id_loop() in Lazy SMP mode. It tells
+  // all the helper threads to search the root position on their own, see
+  // lazy_search(). A thread booked without a split point does that.
+
+  void start_lazy_helpers(const Position& pos, Move searchMoves[]) {
+
+    LazyRootPosition = &pos;
+    LazySearchMoves = searchMoves;
+
+    lock_grab(&MPLock);
+
+    int64_t now = get_system_nanos();
+
+    for(int i = 1; i < ActiveThreads; i++) {
+      assert(Threads[i]->idle);
+      Threads[i]->splitPoint = NULL;
+      Threads[i]->bookedAt = now;
+      Threads[i]->stop = false;
+      Threads[i]->idle = false;
+      Threads[i]->workIsWaiting = true;
+    }
+
+    lock_release(&MPLock);
+
+    for(int i = 1; i < ActiveThreads; i++)
+      wake_thread(i);
+  }
+
+
+  // stop_lazy_helpers() stops the helper threads at the end of a Lazy SMP
+  // search and waits until they are back in their idle loop.
+
+  void stop_lazy_helpers() {
+
+    for(int i = 1; i < ActiveThreads; i++)
+      Threads[i]->stop = true;
+
+    for(int i = 1; i < ActiveThreads; i++)
+      while(!Threads[i]->idle);
+  }
+
+
+  // lazy_search() is the search of a helper thread in Lazy SMP mode. The
+  // thread runs an iterative deepening of its own on a private copy of the
+  // root position and its own search stack. It shares nothing with the
+  // other threads but the transposition table and the history, so that its
+  // only result is the TT entries which make the search of the main thread
+  // faster. To keep the threads from searching the same tree in lock step,
+  // odd helpers search one ply deeper, and each helper starts with the root
+  // moves rotated by its ID, then moves its best move first after each
+  // iteration.
+
+  void lazy_search(int threadID) {
+    assert(threadID > 0 && threadID < ActiveThreads);
+
+    Position pos(*LazyRootPosition);
+    SearchStack* ss = Threads[threadID]->sstack;
+    MoveStack mlist[256];
+    Bitboard dcCandidates = pos.discovered_check_candidates(pos.side_to_move());
+    int count = 0;
+
+    // Pick the root moves, honouring "go searchmoves"
+    MoveStack all[256];
+    int n = generate_legal_moves(pos, all);
+
+    for(int i = 0; i < n; i++) {
+      bool include = (LazySearchMoves[0] == MOVE_NONE);
+      for(int k = 0; !include && LazySearchMoves[k] != MOVE_NONE; k++)
+        include = (LazySearchMoves[k] == all[i].move);
+      if(include)
+        mlist[count++] = all[i];
+    }
+
+    if(count == 0)
+      return;
+
+    std::rotate(mlist, mlist + threadID % count, mlist + count);
+
+    for(int i = 0; i < 3; i++) {
+      ss[i].init(i);
+      ss[i].initKillers();
+    }
+
+    for(int iteration = 2 + threadID % 2; iteration < PLY_MAX; iteration++) {
+      Value alpha = -VALUE_INFINITE;
+      int best = 0;
+
+      for(int i = 0; i < count; i++) {
+        Move move = ss[0].currentMove = mlist[i].move;
+        StateInfo st;
+        Value value;
+        bool dangerous;
+
+        Depth ext = extension(pos, move, true, pos.move_is_capture(move), pos.move_is_check(move), false, false, &dangerous);
+        Depth newDepth = (iteration - 2) * OnePly + ext + InitialDepth;
+
+        pos.do_move(move, st, dcCandidates);
+        if(i == 0)
+          value = -search_pv(pos, ss, -VALUE_INFINITE, -alpha, newDepth, 1, threadID);
+        else {
+          value = -search(pos, ss, -alpha, newDepth, 1, true, threadID);
+          if(value > alpha)
+            value = -search_pv(pos, ss, -VALUE_INFINITE, -alpha, newDepth, 1, threadID);
+        }
+        pos.undo_move(move);
+
+        if(AbortSearch || thread_should_stop(threadID))
+          return;
+
+        if(value > alpha) {
+          alpha = value;
+          best = i;
+        }
+      }
+      std::rotate(mlist, mlist + best, mlist + best + 1);
+    }
+  }
+
+
   // split() does the actual work of distributing the work at a node between
   // several threads at PV nodes.  If it does not succeed in splitting the
   // node (because no idle threads are available, or because we have no unused
@@ -2703,7 +3620,9 @@ namespace {
   // helper threads that they have been assigned work.  This will cause them
   // to instantly leave their idle loops and call sp_search_pv().  When all
   // threads have returned from sp_search_pv (or, equivalently, when
-  // splitPoint->cpus becomes 0), split() returns true.
+  // splitPoint->cpus becomes 0), split() returns true. root_search() splits
+  // the root with ply 0 and no move picker, the threads then search with
+  // sp_search_root().
 
   bool split(const Position& p, SearchStack* sstck, int ply,
              Value* alpha, Value* beta, Value* bestValue, Depth depth, int* moves,
@@ -2719,25 +3638,31 @@ namespace {
     assert(master >= 0 && master < ActiveThreads);
     assert(ActiveThreads > 1);
 
+    assert(sstck == Threads[master]->sstack);
+
     SplitPoint* splitPoint;
     int i;
 
+    SMP_STATS_DO(Threads[master]->smpStats.splitsTried[Min(int(depth) / OnePly, SMPStats::Depths - 1)]++);
+
     lock_grab(&MPLock);
 
+    int64_t start = get_system_nanos();
+
     // If no other thread is available to help us, or if we have too many
     // active split points, don't split.
     if(!idle_thread_exists(master) ||
-       Threads[master].activeSplitPoints >= MaxActiveSplitPoints) {
+       Threads[master]->activeSplitPoints >= MaxActiveSplitPoints) {
       lock_release(&MPLock);
       return false;
     }
 
     // Pick the next available split point object from the split point stack
-    splitPoint = SplitPointStack[master] + Threads[master].activeSplitPoints;
-    Threads[master].activeSplitPoints++;
+    splitPoint = SplitPointStack[master] + Threads[master]->activeSplitPoints;
+    Threads[master]->activeSplitPoints++;
 
     // Initialize the split point object
-    splitPoint->parent = Threads[master].splitPoint;
+    splitPoint->parent = Threads[master]->splitPoint;
     splitPoint->finished = false;
     splitPoint->ply = ply;
     splitPoint->depth = depth;
@@ -2747,39 +3672,72 @@ namespace {
     splitPoint->dcCandidates = dcCandidates;
     splitPoint->bestValue = *bestValue;
     splitPoint->master = master;
-    splitPoint->mp = mp;
     splitPoint->moves = *moves;
+    splitPoint->moveIndex = 0;
+    splitPoint->moveListSize = 0;
     splitPoint->cpus = 1;
     splitPoint->pos.copy(p);
     splitPoint->parentSstack = sstck;
-    for(i = 0; i < ActiveThreads; i++)
-      splitPoint->slaves[i] = 0;
-
-    // Copy the current position and the search stack to the master thread
-    memcpy(splitPoint->sstack[master], sstck, (ply+1)*sizeof(SearchStack));
-    Threads[master].splitPoint = splitPoint;
-
-    // Make copies of the current position and search stack for each thread
+    splitPoint->splitSs = sstck[ply];
+
+    // The master takes slot 0 and keeps searching on its own stack
+    splitPoint->threads[0] = master;
+    splitPoint->slaves[0] = 0;
+    splitPoint->slots = 1;
+    Threads[master]->splitPoint = splitPoint;
+
+    // Pick all the moves left now, in the order of the move picker, so that
+    // the threads can take them without locking. At the root there is no
+    // move picker, the moves left are those of the root move list.
+    if(mp != NULL) {
+      Move m;
+      while((m = mp->get_next_move()) != MOVE_NONE)
+        splitPoint->moveList[splitPoint->moveListSize++] = m;
+    }
+    else
+      for(i = *moves; i < RootMoves->move_count(); i++)
+        splitPoint->moveList[splitPoint->moveListSize++] = RootMoves->get_move(i);
+
+    // Each slave gets a copy of the split ply of the master's stack, as it
+    // was when the node was split, which is all it reads from there. It
+    // writes only the plies above, so the plies below, still in use if the
+    // slave is waiting as the master of an ancestor split point (the
+    // "helpful master"), are left untouched.
     for(i = 0; i < ActiveThreads && splitPoint->cpus < MaxThreadsPerSplitPoint;
         i++)
       if(thread_is_available(i, master)) {
-        memcpy(splitPoint->sstack[i], sstck, (ply+1)*sizeof(SearchStack));
-        Threads[i].splitPoint = splitPoint;
-        splitPoint->slaves[i] = 1;
+        int s = splitPoint->slots++;
+        Threads[i]->sstack[ply] = splitPoint->splitSs;
+        Threads[i]->splitPoint = splitPoint;
+        splitPoint->threads[s] = i;
+        splitPoint->slaves[s] = 1;
         splitPoint->cpus++;
       }
 
     // Tell the threads that they have work to do.  This will make them leave
     // their idle loop.
-    for(i = 0; i < ActiveThreads; i++)
-      if(i == master || splitPoint->slaves[i]) {
-        Threads[i].workIsWaiting = true;
-        Threads[i].idle = false;
-        Threads[i].stop = false;
-      }
+    int64_t now = get_system_nanos();
+    int booked = splitPoint->slots;
+
+    for(i = 0; i < booked; i++) {
+      if(i > 0)
+        Threads[splitPoint->threads[i]]->bookedAt = now;
+      Threads[splitPoint->threads[i]]->workIsWaiting = true;
+      Threads[splitPoint->threads[i]]->idle = false;
+      Threads[splitPoint->threads[i]]->stop = false;
+    }
+
+    Threads[master]->splits++;
+    Threads[master]->splitNanos += now - start;
+    SMP_STATS_DO(Threads[master]->smpStats.splitsDone[Min(int(depth) / OnePly, SMPStats::Depths - 1)]++);
+    SMP_STATS_DO(Threads[master]->smpStats.slaves[Min(booked - 1, SMPStats::Slaves - 1)]++);
 
     lock_release(&MPLock);
 
+    // Wake up the slaves that have gone to sleep
+    for(i = 1; i < booked; i++)
+      wake_thread(splitPoint->threads[i]);
+
     // Everything is set up.  The master thread enters the idle loop, from
     // which it will instantly launch a search, because its workIsWaiting
     // slot is 'true'.  We send the split point as a second parameter to the
@@ -2794,34 +3752,121 @@ namespace {
     if(pvNode) *alpha = splitPoint->alpha;
     *beta = splitPoint->beta;
     *bestValue = splitPoint->bestValue;
-    Threads[master].stop = false;
-    Threads[master].idle = false;
-    Threads[master].activeSplitPoints--;
-    Threads[master].splitPoint = splitPoint->parent;
+    Threads[master]->stop = false;
+    Threads[master]->idle = false;
+    Threads[master]->activeSplitPoints--;
+    Threads[master]->splitPoint = splitPoint->parent;
     lock_release(&MPLock);
 
     return true;
   }
 
 
-  // wake_sleeping_threads() wakes up all sleeping threads when it is time
-  // to start a new search from the root.
+  // sleep_until_woken() puts an idle helper thread to sleep until it has
+  // been assigned work, must exit, or a search with "Late Join" starts.
+  // The flags are checked under the sleep lock of the thread, which
+  // wake_thread() takes too, so that a wake up can not get lost.
+
+  void sleep_until_woken(int threadID) {
+    Thread* t = Threads[threadID];
+
+#if !defined(_MSC_VER)
+    pthread_mutex_lock(&(t->sleepLock));
+    t->sleeping = true;
+    while(!t->workIsWaiting && !AllThreadsShouldExit && !(UseLateJoin && !Idle))
+      pthread_cond_wait(&(t->sleepCond), &(t->sleepLock));
+    t->sleeping = false;
+    pthread_mutex_unlock(&(t->sleepLock));
+#else
+    // Events stay signaled until a wait consumes them, a SetEvent() done
+    // before we get here makes the wait return at once.
+    while(!t->workIsWaiting && !AllThreadsShouldExit && !(UseLateJoin && !Idle))
+      WaitForSingleObject(t->sleepEvent, INFINITE);
+#endif
+  }
+
+
+  // wake_thread() wakes up a thread if it is sleeping. Called after having
+  // set its workIsWaiting flag, or AllThreadsShouldExit.
+
+  void wake_thread(int threadID) {
+    Thread* t = Threads[threadID];
 
-  void wake_sleeping_threads() {
-    if(ActiveThreads > 1) {
-      for(int i = 1; i < ActiveThreads; i++) {
-        Threads[i].idle = true;
-        Threads[i].workIsWaiting = false;
-      }
 #if !defined(_MSC_VER)
-      pthread_mutex_lock(&WaitLock);
-      pthread_cond_broadcast(&WaitCond);
-      pthread_mutex_unlock(&WaitLock);
+    pthread_mutex_lock(&(t->sleepLock));
+    if(t->sleeping)
+      pthread_cond_signal(&(t->sleepCond));
+    pthread_mutex_unlock(&(t->sleepLock));
 #else
-      for(int i = 1; i < THREAD_MAX; i++)
-        SetEvent(SitIdleEvent[i]);
+    SetEvent(t->sleepEvent);
 #endif
+  }
+
+
+  // wake_sleeping_threads() wakes up all sleeping threads, used when they
+  // must exit or when a search with "Late Join" starts.
+
+  void wake_sleeping_threads() {
+    for(int i = 1; i < ActiveThreads; i++)
+      wake_thread(i);
+  }
+
+
+  // grab_sp_lock() takes the lock of a split point. With -DSMP_STATS it also
+  // measures how long the thread has waited for it.
+
+  void grab_sp_lock(SplitPoint* sp, int threadID) {
+#if defined(SMP_STATS)
+    int64_t start = get_system_nanos();
+    lock_grab(&(sp->lock));
+    Threads[threadID]->smpStats.lockWaits++;
+    Threads[threadID]->smpStats.lockNanos += get_system_nanos() - start;
+#else
+    lock_grab(&(sp->lock));
+#endif
+  }
+
+
+#if defined(SMP_STATS)
+
+  // thread_smp_stats() returns the statistics of a thread in the current
+  // search, with its nodes and its idle time, counted as in smp_info().
+
+  SMPStats thread_smp_stats(int threadID) {
+    SMPStats s = Threads[threadID]->smpStats;
+    int64_t elapsed = get_system_nanos() - SearchStartNanos;
+
+    s.nodes = Threads[threadID]->nodes;
+    s.threadNanos = elapsed;
+    s.idleNanos = Threads[threadID]->idleNanos;
+    if(threadID > 0)
+      s.idleNanos += Max(elapsed - Threads[threadID]->busyNanos, int64_t(0));
+
+    return s;
+  }
+
+#endif
+
+
+  // print_smp_stats() writes the statistics of the parallel search at the
+  // end of a search, the sum over all the threads and a line per thread.
+  // Nothing is written unless the program has been compiled with -DSMP_STATS.
+
+  void print_smp_stats(std::ostream& os, const std::string& prefix) {
+#if defined(SMP_STATS)
+    smp_stats(false).print(os, prefix);
+
+    for(int i = 0; i < ActiveThreads; i++) {
+      SMPStats s = thread_smp_stats(i);
+      os << prefix << "SMP thread " << i
+         << " nodes " << s.nodes
+         << " idle " << (s.threadNanos ? 100.0 * s.idleNanos / s.threadNanos : 0) << "%"
+         << " splits " << Threads[i]->splits
+         << " cutoffs " << s.cutoffs
+         << " wasted nodes " << s.wastedNodes
+         << " lock waits " << s.lockWaits << std::endl;
     }
+#endif
   }
 
 
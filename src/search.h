@@ -25,6 +25,9 @@
 //// Includes
 ////
 
+#include <iostream>
+#include <string>
+
 #include "depth.h"
 #include "move.h"
 
@@ -60,6 +63,58 @@ struct SearchStack {
 };
 
 
+/// SMPInfo is what the SMP benchmark reports about the parallel search,
+/// see smp_info().
+
+struct SMPInfo {
+  int64_t splits;     // Split points created in the last search
+  int64_t splitNanos; // Time spent by the masters to set them up
+  int64_t lateJoins;  // Split points joined by idle threads, see "Late Join"
+  int64_t idleNanos;  // Time spent by the threads waiting for work
+  int64_t wakeups;    // Threads booked by split()
+  int64_t wakeNanos;  // Time from their booking to the start of their work
+  size_t threadBytes; // Search data allocated for each thread
+};
+
+
+/// SMPStats collects statistics on the parallel search, to find out where
+/// the threads lose their time. As TTStats, it is compiled in only with
+/// -DSMP_STATS, otherwise the SMP_STATS_DO() macro throws away the code
+/// updating it. Each thread updates its own copy, smp_stats() sums them.
+///
+/// A split point is "tried" each time the search calls split(), which may
+/// find no idle thread to book. Wasted nodes are those of the moves whose
+/// search has been aborted by a beta cutoff at a split point.
+
+#if defined(SMP_STATS)
+#  define SMP_STATS_DO(x) x
+#else
+#  define SMP_STATS_DO(x)
+#endif
+
+struct SMPStats {
+
+  static const int Depths = 32;
+  static const int Slaves = 8;
+
+  void clear();
+  void add(const SMPStats& s);
+  void print(std::ostream& os, const std::string& prefix) const;
+  void print_line(std::ostream& os) const;
+
+  uint64_t splitsTried[Depths]; // By depth in plies
+  uint64_t splitsDone[Depths];
+  uint64_t slaves[Slaves];      // Split points by number of slaves booked
+  uint64_t cutoffs;             // Beta cutoffs at split points
+  uint64_t wastedNodes;
+  uint64_t lockWaits;           // Grabs of the lock of a split point
+  uint64_t lockNanos;           // Time spent waiting for it
+  uint64_t nodes;
+  uint64_t threadNanos;         // Search time of all the threads
+  uint64_t idleNanos;           // Part of it spent waiting for work
+};
+
+
 ////
 //// Prototypes
 ////
@@ -70,6 +125,8 @@ extern bool think(const Position &pos, bool infinite, bool ponder, int side_to_m
                   int time[], int increment[], int movesToGo, int maxDepth,
                   int maxNodes, int maxTime, Move searchMoves[]);
 extern int64_t nodes_searched();
+extern SMPInfo smp_info();
+extern SMPStats smp_stats(bool total);
 
 
 #endif // !defined(SEARCH_H_INCLUDED)
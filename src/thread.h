@@ -26,6 +26,12 @@
 //// Includes
 ////
 
+#if !defined(_MSC_VER)
+#  include <pthread.h>
+#else
+#  include <windows.h>
+#endif
+
 #include "lock.h"
 #include "movepick.h"
 #include "position.h"
@@ -36,45 +42,148 @@
 //// Constants and variables
 ////
 
-const int THREAD_MAX = 8;
+// Upper bound of the "Threads" UCI option. Nothing is sized from it, the
+// thread data is allocated at runtime for the threads actually in use.
+const int THREAD_MAX = 512;
+
+// Upper bound of the "Maximum Number of Threads per Split Point" option
+const int SPLIT_MAX = 8;
 
 
 ////
 //// Types
 ////
 
+/// SplitPoint holds the data shared by the threads searching a node in
+/// parallel. The threads are booked in slots, the master in slot 0, so
+/// that the per-thread data of a split point does not grow with the
+/// total number of threads. Search stacks are not kept here, each thread
+/// searches on its own Thread::sstack, see split().
+///
+/// The moves left at the node are picked once by split() and handed out
+/// with an atomic index, and bestValue and alpha are raised with compare
+/// and swap, so that the lock is taken only to update the PV.
+
 struct SplitPoint {
+
+  int slot(int threadID) const;
+  bool is_slave(int threadID) const;
+  Move next_move(int* moveCount);
+  bool no_more_moves() const;
+
   SplitPoint *parent;
   Position pos;
-  SearchStack sstack[THREAD_MAX][PLY_MAX];
-  SearchStack *parentSstack;
+  SearchStack *parentSstack; // Search stack of the master
+  SearchStack splitSs;       // Split ply of the master's stack when split
   int ply;
   Depth depth;
   volatile Value alpha, beta, bestValue;
   bool pvNode;
   Bitboard dcCandidates;
-  int master, slaves[THREAD_MAX];
+  int master;
+  int slots;              // Number of booked slots
+  int threads[SPLIT_MAX]; // Thread in each slot
+  int slaves[SPLIT_MAX];  // Non zero while the slave in the slot is searching
   Lock lock;
-  MovePicker *mp;
-  volatile int moves;
+  Move moveList[256];      // Moves left when the node was split, in order
+  int moveListSize;
+  volatile int moveIndex;  // Next move of moveList to hand out
+  int moves;               // Moves searched by the master before the split
   volatile int cpus;
   bool finished;
 };
 
 
 struct Thread {
-  SplitPoint *splitPoint;
-  int activeSplitPoints;
+  // Counters written at every node by the thread alone. They fill the first
+  // cache line of the Thread object, which is page aligned, so that writing
+  // them does not evict the flags below that the other threads poll.
   uint64_t nodes;
   uint64_t betaCutOffs[2];
+  unsigned char counterPad[64 - 3 * sizeof(uint64_t)];
+
+  SplitPoint *splitPoint;
+  int activeSplitPoints;
   bool failHighPly1;
   volatile bool stop;
   volatile bool running;
   volatile bool idle;
   volatile bool workIsWaiting;
   volatile bool printCurrentLine;
+  int numaNode;  // node assigned by think(), -1 if none
+  int boundNode; // node the thread is currently bound to
+  int cpu;       // CPU assigned by think(), -1 if none
+  int boundCpu;  // CPU the thread is currently pinned to
+  int64_t splits;        // Split points created, for the SMP benchmark
+  int64_t splitNanos;    // Time spent to set them up
+  int64_t lateJoins;     // Split points joined after they were set up
+  int64_t idleNanos;     // Time spent waiting as the master of a split point
+  int64_t busyNanos;     // Time spent searching when called by a split point
+  volatile int64_t bookedAt; // When split() booked the thread, 0 if not
+  int64_t wakeups;       // Number of bookings by split()
+  int64_t wakeNanos;     // Time from the bookings to the start of the work
+  int64_t spinNanos;     // How long to spin before to sleep, see idle_loop()
+#if defined(SMP_STATS)
+  SMPStats smpStats;
+#endif
+  volatile bool sleeping;
+#if !defined(_MSC_VER)
+  pthread_mutex_t sleepLock;
+  pthread_cond_t sleepCond;
+#else
+  HANDLE sleepEvent;
+#endif
   unsigned char pad[64]; // set some distance among local data for each thread
+  SearchStack sstack[PLY_MAX_PLUS_2];
+  History history;       // Used instead of the shared one with "Thread History"
 };
 
 
+////
+//// Inline functions
+////
+
+/// SplitPoint::slot() returns the slot of a thread booked at the split
+/// point, or -1 if the thread is not booked.
+
+inline int SplitPoint::slot(int threadID) const {
+
+  for (int i = 0; i < slots; i++)
+      if (threads[i] == threadID)
+          return i;
+
+  return -1;
+}
+
+/// SplitPoint::is_slave() tests whether a thread is still searching at the
+/// split point as a slave.
+
+inline bool SplitPoint::is_slave(int threadID) const {
+
+  int i = slot(threadID);
+  return i > 0 && slaves[i];
+}
+
+/// SplitPoint::next_move() hands out the next move to search, or MOVE_NONE
+/// when there are no moves left. 'moveCount' receives the number of the move
+/// at the node, counting the moves searched before the split.
+
+inline Move SplitPoint::next_move(int* moveCount) {
+
+  int i = atomic_fetch_add_int(&moveIndex, 1);
+  if (i >= moveListSize)
+      return MOVE_NONE;
+
+  *moveCount = moves + i + 1;
+  return moveList[i];
+}
+
+/// SplitPoint::no_more_moves() tells whether all the moves have been handed
+/// out.
+
+inline bool SplitPoint::no_more_moves() const {
+  return moveIndex >= moveListSize;
+}
+
+
 #endif // !defined(THREAD_H_INCLUDED)
@@ -22,148 +22,690 @@
 //// Includes
 ////
 
+#if !defined(_MSC_VER)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <pthread.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#else
+#  include <windows.h>
+#endif
+
 #include <cassert>
-#include <cmath>
 #include <cstring>
+#include <fstream>
+#include <iostream>
 
+#include "thread.h"
 #include "tt.h"
+#include "ucioption.h"
+
+
+////
+//// Local definitions
+////
+
+namespace {
+
+#if !defined(_MSC_VER)
+
+#  if !defined(MAP_ANONYMOUS)
+#    define MAP_ANONYMOUS MAP_ANON
+#  endif
+
+#  if defined(__linux__) && !defined(MAP_HUGETLB)
+#    define MAP_HUGETLB 0x40000
+#  endif
+
+#  if defined(__linux__) && !defined(MAP_HUGE_SHIFT)
+#    define MAP_HUGE_SHIFT 26
+#  endif
+
+#endif
+
+  const size_t OneGB = size_t(1) << 30;
+  const size_t TwoMB = size_t(1) << 21;
+
+  // DumpHeader is written at the beginning of a file created by save(),
+  // followed by the raw image of the table, cluster after cluster.
+  struct DumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint64_t clusters;
+    uint32_t generation;
+    uint32_t reserved;
+  };
+
+  const char DumpMagic[8] = { 'S', 'F', 'T', 'T', 'D', 'U', 'M', 'P' };
+  const uint32_t DumpVersion = 1;
+
+  // Files are read and written in blocks of this size
+  const size_t DumpBlock = size_t(64) << 20;
+
+  const char* PageNames[] = {
+    "", "normal pages", "transparent huge pages", "2MB huge pages", "1GB huge pages"
+  };
+
+  // try_alloc() tries to get 'bytes' of zero initialized memory backed by
+  // the given kind of pages. Returns NULL if the kernel refuses to do so.
+
+  void* try_alloc(size_t bytes, PagePolicy pages) {
+
+#if !defined(_MSC_VER)
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#  if defined(__linux__)
+    if (pages == PAGES_HUGE_1GB)
+        flags |= MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+
+    else if (pages == PAGES_HUGE_2MB)
+        flags |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+#  else
+    if (pages == PAGES_HUGE_1GB || pages == PAGES_HUGE_2MB || pages == PAGES_TRANSPARENT)
+        return NULL;
+#  endif
+
+    void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+#  if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (pages == PAGES_TRANSPARENT && madvise(mem, bytes, MADV_HUGEPAGE))
+    {
+        munmap(mem, bytes);
+        return NULL;
+    }
+#  endif
+    return mem;
+
+#else
+
+    if (pages != PAGES_NORMAL)
+        return NULL;
+
+    return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+#endif
+  }
+
+  // Tables smaller than this are cleared by the calling thread alone,
+  // launching the helpers would cost more than what we save.
+  const size_t MinParallelClear = size_t(32) << 20;
+
+  // ClearChunk is the slice of the table zeroed by one thread
+  struct ClearChunk {
+    char* start;
+    size_t bytes;
+  };
+
+#if !defined(_MSC_VER)
+  void* clear_chunk(void* c) {
+#else
+  DWORD WINAPI clear_chunk(LPVOID c) {
+#endif
+
+    memset(((ClearChunk*)c)->start, 0, ((ClearChunk*)c)->bytes);
+    return 0;
+  }
+
+  // The table of a shared memory segment starts after a page reserved for
+  // the header. The creator writes the magic last, once the header is
+  // complete, and who attaches waits for it at most SharedWaitMs.
+  const size_t SharedHeaderBytes = 4096;
+  const int SharedWaitMs = 2000;
+  const char SharedMagic[8] = { 'S', 'F', 'T', 'T', 'S', 'H', 'M', '1' };
+
+  // POSIX wants the name of a segment to start with a slash
+  std::string shared_path(const std::string& name) {
+
+    return name[0] == '/' ? name : "/" + name;
+  }
+
+  void free_mem(void* mem, size_t bytes) {
+
+#if !defined(_MSC_VER)
+    munmap(mem, bytes);
+#else
+    VirtualFree(mem, 0, MEM_RELEASE);
+    bytes = 0; // Silence a warning
+#endif
+  }
+
+}
+
+
+/// TTSharedHeader is stored at the beginning of a shared memory segment.
+/// 'attached' counts the processes using the segment, the last one to leave
+/// removes it. 'generation' is shared, so that all the processes agree on
+/// which entries are from an old search.
+
+struct TTSharedHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entrySize;
+  uint64_t clusters;
+  volatile int attached;
+  volatile int generation;
+  uint64_t inode;
+};
+
+namespace {
+
+#if !defined(_MSC_VER)
+
+  // attach_shared() maps the table of the given number of clusters and entry
+  // size from the segment 'name', creating the segment if it does not exist.
+  // A stale segment of a different layout, with no process attached, is
+  // removed and created again. Returns NULL if the segment is in use with a
+  // different layout, or on any error. 'created' tells if the table is new,
+  // and so it must be cleared.
+
+  TTSharedHeader* attach_shared(const std::string& name, uint64_t clusters,
+                                uint32_t entrySize, bool* created) {
+
+    std::string path = shared_path(name);
+    size_t total = SharedHeaderBytes + size_t(clusters) * ClusterBytes;
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0)
+        {
+            void* mem = MAP_FAILED;
+            struct stat st;
+            if (!ftruncate(fd, off_t(total)) && !fstat(fd, &st))
+                mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (mem == MAP_FAILED)
+            {
+                shm_unlink(path.c_str());
+                return NULL;
+            }
+            TTSharedHeader* h = (TTSharedHeader*)mem;
+            h->version = 1;
+            h->entrySize = entrySize;
+            h->clusters = clusters;
+            h->attached = 1;
+            h->generation = 0;
+            h->inode = uint64_t(st.st_ino);
+            __sync_synchronize();
+            memcpy(h->magic, SharedMagic, sizeof(SharedMagic));
+            *created = true;
+            return h;
+        }
+        if (errno != EEXIST)
+            return NULL;
+
+        // The segment exists, wait until its creator has sized it
+        fd = shm_open(path.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            continue; // Removed in the meanwhile, try to create it
+
+        struct stat st;
+        for (int ms = 0; !fstat(fd, &st) && st.st_size == 0 && ms < SharedWaitMs; ms++)
+            usleep(1000);
+
+        if (size_t(st.st_size) < SharedHeaderBytes)
+        {
+            close(fd);
+            return NULL;
+        }
+        void* mem = mmap(NULL, size_t(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED)
+            return NULL;
+
+        TTSharedHeader* h = (TTSharedHeader*)mem;
+        for (int ms = 0; memcmp(h->magic, SharedMagic, sizeof(SharedMagic)) && ms < SharedWaitMs; ms++)
+            usleep(1000);
+
+        if (   !memcmp(h->magic, SharedMagic, sizeof(SharedMagic))
+            && h->version == 1
+            && h->entrySize == entrySize
+            && h->clusters == clusters
+            && size_t(st.st_size) == total)
+        {
+            __sync_add_and_fetch(&h->attached, 1);
+            *created = false;
+            return h;
+        }
+
+        // Different layout: recreate it only if nobody is using it
+        bool stale = (h->attached <= 0);
+        munmap(mem, size_t(st.st_size));
+        if (!stale)
+            return NULL;
+
+        shm_unlink(path.c_str());
+    }
+    return NULL;
+  }
+
+  // detach_shared() unmaps a table attached with attach_shared(), the last
+  // process to leave also removes the segment, unless the name has been
+  // reused in the meanwhile for a new segment, see reset_shared().
+
+  void detach_shared(TTSharedHeader* h, const std::string& name) {
+
+    size_t total = SharedHeaderBytes + size_t(h->clusters) * ClusterBytes;
+    std::string path = shared_path(name);
+
+    if (__sync_sub_and_fetch(&h->attached, 1) == 0)
+    {
+        struct stat st;
+        int fd = shm_open(path.c_str(), O_RDONLY, 0);
+
+        if (fd >= 0 && !fstat(fd, &st) && uint64_t(st.st_ino) == h->inode)
+            shm_unlink(path.c_str());
+
+        if (fd >= 0)
+            close(fd);
+    }
+    munmap(h, total);
+  }
+
+#endif
+
+}
+
+
+////
+//// Variables
+////
+
+// The main transposition table, shared by all the threads
+TranspositionTable<TTSlot> TT;
 
 
 ////
 //// Functions
 ////
 
-TranspositionTable::TranspositionTable() {
+template<class Entry>
+TranspositionTable<Entry>::TranspositionTable() {
 
-  size = writes = 0;
+  size = 0;
   entries = 0;
   generation = 0;
+  requested = obtained = PAGES_AUTO;
+  interleaved = false;
+  shared = NULL;
+
+#if defined(TT_STATS)
+  threadStats = new ThreadStats[THREAD_MAX];
+  for (int i = 0; i < THREAD_MAX; i++)
+      threadStats[i].stats.clear();
+
+  searchStart.clear();
+#endif
 }
 
-TranspositionTable::~TranspositionTable() {
+template<class Entry>
+TranspositionTable<Entry>::~TranspositionTable() {
 
-  delete [] entries;
+  free_entries();
+  TT_STATS_DO(delete [] threadStats);
 }
 
 
 /// TranspositionTable::set_size sets the size of the transposition table,
-/// measured in megabytes.
+/// measured in megabytes, and the kind of pages we want the table to live
+/// in. If the requested pages are not available we fall back on smaller
+/// ones, see backing() to know what we actually got.
+///
+/// When the "Shared Hash" option names a POSIX shared memory segment, the
+/// table lives there instead and is shared with the other engine processes
+/// using the same name, Hash size and entry layout. Entries are lockless
+/// (see TTEntry), so processes work on it exactly as threads do. If the
+/// segment cannot be used we fall back on a private table.
 
-void TranspositionTable::set_size(unsigned mbSize) {
+template<class Entry>
+void TranspositionTable<Entry>::set_size(unsigned mbSize, PagePolicy policy) {
 
-  assert(mbSize >= 4 && mbSize <= 4096);
+  assert(mbSize >= 4);
 
-  unsigned newSize = 1024;
+  // On 32 bit systems we cannot address more than a couple of GB anyhow
+  if (sizeof(size_t) < 8)
+      mbSize = Min(mbSize, 2048U);
 
-  // We store a cluster of 4 TTEntry for each position and newSize is
-  // the maximum number of storable positions
-  while ((2 * newSize) * 4 * (sizeof(TTEntry)) <= (mbSize << 20))
+  size_t newSize = 1024;
+
+  assert(Entry::ClusterSize * sizeof(Entry) <= size_t(ClusterBytes));
+
+  // We store a cluster of entries for each position and newSize is
+  // the number of clusters.
+  while ((2 * newSize) * ClusterBytes <= (size_t(mbSize) << 20))
       newSize *= 2;
 
-  if (newSize != size)
+  // With NUMA the table is spread over all the nodes, no thread is
+  // more important than the others.
+  bool numa = get_option_value_bool("NUMA");
+  std::string shmName = get_option_value_string("Shared Hash");
+
+  if (   newSize == size && policy == requested && numa == interleaved
+      && shmName == sharedName)
+      return;
+
+  free_entries();
+  size = newSize;
+  requested = policy;
+  interleaved = numa;
+  sharedName = shmName;
+
+  size_t bytes = size * ClusterBytes;
+
+  if (!sharedName.empty())
   {
-      size = newSize;
-      delete [] entries;
-      entries = new TTEntry[size * 4];
-      if (!entries)
+      bool created = false;
+
+#if !defined(_MSC_VER)
+      shared = attach_shared(sharedName, size, sizeof(Entry), &created);
+#endif
+      if (shared)
       {
-          std::cerr << "Failed to allocate " << mbSize
-                    << " MB for transposition table." << std::endl;
-          Application::exit_with_failure();
+          entries = (Entry*)((char*)shared + SharedHeaderBytes);
+          generation = uint8_t(shared->generation);
+
+          std::cout << "info string Hash " << (bytes >> 20) << " MB "
+                    << (created ? "created" : "attached") << " in shared memory "
+                    << sharedName << std::endl;
+          if (created)
+              clear();
+          return;
       }
-      clear();
+      std::cout << "info string Shared hash " << sharedName
+                << " not available, using a private one" << std::endl;
+  }
+
+  // Walk down the fallback chain starting from the requested policy. Huge
+  // pages can be used only when the table is a multiple of their size.
+  PagePolicy p = (policy == PAGES_AUTO ? PAGES_HUGE_2MB : policy);
+
+  for ( ; !entries && p != PAGES_AUTO; p = PagePolicy(p - 1))
+  {
+      if (   (p == PAGES_HUGE_1GB && bytes % OneGB)
+          || (p == PAGES_HUGE_2MB && bytes % TwoMB))
+          continue;
+
+      entries = (Entry*)try_alloc(bytes, p);
+      obtained = p;
+  }
+
+  // Memory comes page aligned, so each cluster of entries sits
+  // exactly in one cache line.
+  assert((size_t(entries) & 63) == 0);
+
+  if (!entries)
+  {
+      std::cerr << "Failed to allocate " << mbSize
+                << " MB for transposition table." << std::endl;
+      Application::exit_with_failure();
   }
+
+  // Must be done before the first touch, that is before clear()
+  if (interleaved)
+      interleave_memory(entries, bytes);
+
+  std::cout << "info string Hash " << (bytes >> 20) << " MB on "
+            << backing() << (interleaved ? ", interleaved" : "") << std::endl;
+
+  clear();
+}
+
+
+/// TranspositionTable::free_entries() releases the memory of the table
+
+template<class Entry>
+void TranspositionTable<Entry>::free_entries() {
+
+#if !defined(_MSC_VER)
+  if (shared)
+      detach_shared(shared, sharedName);
+  else
+#endif
+  if (entries)
+      free_mem(entries, size * ClusterBytes);
+
+  entries = NULL;
+  shared = NULL;
+  size = 0;
+}
+
+
+/// TranspositionTable::reset_shared() removes the name of the shared memory
+/// segment, and releases the table, so that the next set_size() will create
+/// a new segment. Processes still attached to the old one can keep using it
+/// safely, it goes away when the last of them detaches. Useful to get rid of
+/// a segment of a different size, or left in use by a crashed process.
+
+template<class Entry>
+void TranspositionTable<Entry>::reset_shared() {
+
+#if !defined(_MSC_VER)
+  std::string name = get_option_value_string("Shared Hash");
+
+  if (!name.empty())
+      shm_unlink(shared_path(name).c_str());
+#endif
+
+  free_entries();
+}
+
+
+/// TranspositionTable::shared_with_others() returns true if the table is in
+/// a shared memory segment used also by other processes. The search does not
+/// clear such a table on "ucinewgame", it would throw away their work.
+
+template<class Entry>
+bool TranspositionTable<Entry>::shared_with_others() const {
+
+  return shared && shared->attached > 1;
+}
+
+
+/// TranspositionTable::backing() returns a description of the kind of pages
+/// that actually back the table. Used to report in the search log.
+
+template<class Entry>
+const char* TranspositionTable<Entry>::backing() const {
+
+  return shared ? "shared memory" : entries ? PageNames[obtained] : "no memory";
 }
 
 
 /// TranspositionTable::clear overwrites the entire transposition table
 /// with zeroes. It is called whenever the table is resized, or when the
-/// user asks the program to clear the table (from the UCI interface).
-/// Perhaps we should also clear it when the "ucinewgame" command is recieved?
+/// user asks the program to clear the table (from the UCI interface, also
+/// on "ucinewgame"). A big table is split in chunks zeroed in parallel by
+/// as many threads as the "Threads" option, so that clearing a multi-GB
+/// table does not stall the GUI. The clearing threads are not bound to any
+/// node: with "NUMA" the pages are placed by interleave_memory() before
+/// the first touch, see set_size(), otherwise they go to the node where
+/// the thread touching them first happens to run.
+
+template<class Entry>
+void TranspositionTable<Entry>::clear() {
+
+  size_t bytes = size * ClusterBytes;
+  int threads = get_option_value_int("Threads");
+
+  if (threads <= 1 || bytes < MinParallelClear)
+  {
+      memset(entries, 0, bytes);
+      return;
+  }
 
-void TranspositionTable::clear() {
+  // Chunks are a multiple of 2MB so that a huge page is touched by one
+  // thread only. The last chunk takes what remains.
+  size_t chunkSize = (bytes / threads + TwoMB - 1) & ~(TwoMB - 1);
+  ClearChunk* chunks = new ClearChunk[threads];
+  int n = 0;
 
-  memset(entries, 0, size * 4 * sizeof(TTEntry));
+  for (size_t done = 0; done < bytes; done += chunkSize, n++)
+  {
+      chunks[n].start = (char*)entries + done;
+      chunks[n].bytes = Min(chunkSize, bytes - done);
+  }
+
+#if !defined(_MSC_VER)
+  pthread_t* handles = new pthread_t[threads];
+#else
+  HANDLE* handles = new HANDLE[threads];
+  DWORD iID[1];
+#endif
+  bool* launched = new bool[threads];
+
+  // The calling thread clears the first chunk by itself, and also the
+  // chunks for which a helper could not be launched.
+  for (int i = 1; i < n; i++)
+  {
+#if !defined(_MSC_VER)
+      launched[i] = !pthread_create(&handles[i], NULL, clear_chunk, (void*)(&chunks[i]));
+#else
+      handles[i] = CreateThread(NULL, 0, clear_chunk, (LPVOID)(&chunks[i]), 0, iID);
+      launched[i] = (handles[i] != NULL);
+#endif
+      if (!launched[i])
+          clear_chunk(&chunks[i]);
+  }
+
+  clear_chunk(&chunks[0]);
+
+  for (int i = 1; i < n; i++)
+  {
+      if (!launched[i])
+          continue;
+#if !defined(_MSC_VER)
+      pthread_join(handles[i], NULL);
+#else
+      WaitForSingleObject(handles[i], INFINITE);
+      CloseHandle(handles[i]);
+#endif
+  }
+
+  delete [] chunks;
+  delete [] handles;
+  delete [] launched;
 }
 
 
 /// TranspositionTable::store writes a new entry containing a position,
 /// a value, a value type, a search depth, and a best move to the
 /// transposition table. Transposition table is organized in clusters of
-/// four TTEntry objects, and when a new entry is written, it replaces
-/// the least valuable of the four entries in a cluster. A TTEntry t1 is
-/// considered to be more valuable than a TTEntry t2 if t1 is from the
+/// Entry::ClusterSize entries, and when a new entry is written, it replaces
+/// the least valuable of the entries in a cluster. An entry t1 is
+/// considered to be more valuable than an entry t2 if t1 is from the
 /// current search and t2 is from a previous search, or if the depth of t1
-/// is bigger than the depth of t2. A TTEntry of type VALUE_TYPE_EVAL
-/// never replaces another entry for the same position.
+/// is bigger than the depth of t2. An entry of type VALUE_TYPE_EVAL
+/// never replaces another entry for the same position. 'threadID' is the
+/// thread calling, whose statistics are updated.
 
-void TranspositionTable::store(const Key posKey, Value v, ValueType t, Depth d, Move m) {
+template<class Entry>
+void TranspositionTable<Entry>::store(const Key posKey, Value v, ValueType t, Depth d, Move m, int threadID) {
 
-  TTEntry *tte, *replace;
+  Entry *tte, *replace;
+  TTEntry e, r;
+
+  TT_STATS_DO(TTStats& stats = threadStats[threadID].stats);
 
   tte = replace = first_entry(posKey);
-  for (int i = 0; i < 4; i++, tte++)
+  for (int i = 0; i < Entry::ClusterSize; i++, tte++)
   {
-      if (!tte->key() || tte->key() == posKey) // empty or overwrite old
+      e = TTEntry(posKey, tte->raw());
+
+      if (tte->empty() || tte->matches(posKey)) // empty or overwrite old
       {
           // Do not overwrite when new type is VALUE_TYPE_EVAL
-          if (tte->key() && t == VALUE_TYPE_EVAL)
+          if (!tte->empty() && t == VALUE_TYPE_EVAL)
               return;
 
+          TT_STATS_DO(tte->empty() ? stats.emptyWrites++ : stats.sameKeyWrites++);
+
           if (m == MOVE_NONE)
-              m = tte->move();
+              m = e.move();
 
-          *tte = TTEntry(posKey, v, t, d, m, generation);
+          tte->save(posKey, TTEntry::pack(v, t, d, m, generation));
           return;
       }
       else if (i == 0)  // replace would be a no-op in this common case
+      {
+          r = e;
           continue;
+      }
 
-      int c1 = (replace->generation() == generation ?  2 : 0);
-      int c2 = (tte->generation() == generation ? -2 : 0);
-      int c3 = (tte->depth() < replace->depth() ?  1 : 0);
+      int c1 = (r.generation() == generation ?  2 : 0);
+      int c2 = (e.generation() == generation ? -2 : 0);
+      int c3 = (e.depth() < r.depth() ?  1 : 0);
 
       if (c1 + c2 + c3 > 0)
+      {
           replace = tte;
+          r = e;
+      }
   }
-  *replace = TTEntry(posKey, v, t, d, m, generation);
-  writes++;
+  TT_STATS_DO(stats.evict(d, r, generation));
+
+  replace->save(posKey, TTEntry::pack(v, t, d, m, generation));
 }
 
 
 /// TranspositionTable::retrieve looks up the current position in the
-/// transposition table. Returns a pointer to the TTEntry or NULL
-/// if position is not found.
+/// transposition table. If the position is found the entry is copied into
+/// the object pointed by tte, and a pointer to it is returned, otherwise
+/// NULL is returned. Working on a private copy guarantees the entry can
+/// not change under our feet, and checking the key on the copy rejects
+/// entries torn by a concurrent store() from another thread. Empty slots
+/// are skipped, a compact slot full of zeros would otherwise match every
+/// key with a zero check word. 'threadID' is as in store().
 
-TTEntry* TranspositionTable::retrieve(const Key posKey) const {
+template<class Entry>
+const TTEntry* TranspositionTable<Entry>::retrieve(const Key posKey, TTEntry* tte, int threadID) const {
 
-  TTEntry *tte = first_entry(posKey);
+  const Entry* e = first_entry(posKey);
+  Entry copy;
 
-  for (int i = 0; i < 4; i++, tte++)
-      if (tte->key() == posKey)
-          return tte;
+  TT_STATS_DO(TTStats& stats = threadStats[threadID].stats);
+  TT_STATS_DO(bool full = true);
+  TT_STATS_DO(stats.probes++);
 
+  for (int i = 0; i < Entry::ClusterSize; i++, e++)
+  {
+      copy = *e;
+      if (!copy.empty() && copy.matches(posKey))
+      {
+          TT_STATS_DO(stats.hits++);
+          *tte = TTEntry(posKey, copy.raw());
+          return tte;
+      }
+      TT_STATS_DO(full = full && !copy.empty());
+  }
+  TT_STATS_DO(if (full) stats.collisions++);
   return NULL;
 }
 
 
-/// TranspositionTable::first_entry returns a pointer to the first
-/// entry of a cluster given a position.
-
-inline TTEntry* TranspositionTable::first_entry(const Key posKey) const {
-
-  return entries + (int(posKey & (size - 1)) << 2);
-}
-
 /// TranspositionTable::new_search() is called at the beginning of every new
 /// search. It increments the "generation" variable, which is used to
 /// distinguish transposition table entries from previous searches from
-/// entries from the current search.
+/// entries from the current search. A shared table has a single generation
+/// counter for all the processes.
+
+template<class Entry>
+void TranspositionTable<Entry>::new_search() {
 
-void TranspositionTable::new_search() {
+#if !defined(_MSC_VER)
+  if (shared)
+      generation = uint8_t(__sync_add_and_fetch(&shared->generation, 1));
+  else
+#endif
+      generation++;
 
-  generation++;
-  writes = 0;
+  TT_STATS_DO(searchStart = total_stats());
 }
 
 
@@ -172,25 +714,297 @@ void TranspositionTable::new_search() {
 /// the old PV moves are searched first, even if the old TT entries
 /// have been overwritten.
 
-void TranspositionTable::insert_pv(const Position& pos, Move pv[]) {
+template<class Entry>
+void TranspositionTable<Entry>::insert_pv(const Position& pos, Move pv[]) {
 
   StateInfo st;
   Position p(pos);
 
   for (int i = 0; pv[i] != MOVE_NONE; i++)
   {
-      store(p.get_key(), VALUE_NONE, VALUE_TYPE_NONE, Depth(-127*OnePly), pv[i]);
+      store(p.get_key(), VALUE_NONE, VALUE_TYPE_NONE, Depth(-127*OnePly), pv[i], 0);
       p.do_move(pv[i], st);
   }
 }
 
 
-/// TranspositionTable::full() returns the permill of all transposition table
-/// entries which have received at least one write during the current search.
-/// It is used to display the "info hashfull ..." information in UCI.
+/// TranspositionTable::save() writes the table and the current generation
+/// to a file, so that a long analysis can be resumed after a restart. The
+/// file is just a small header followed by the memory image of the table.
+
+template<class Entry>
+bool TranspositionTable<Entry>::save(const std::string& fileName) const {
+
+  if (!entries)
+      return false;
+
+  std::ofstream file(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+      return false;
+
+  DumpHeader h;
+  memset(&h, 0, sizeof(DumpHeader));
+  memcpy(h.magic, DumpMagic, sizeof(DumpMagic));
+  h.version = DumpVersion;
+  h.entrySize = sizeof(Entry);
+  h.clusters = size;
+  h.generation = generation;
+
+  file.write((const char*)&h, sizeof(DumpHeader));
 
-int TranspositionTable::full() const {
+  size_t bytes = size * ClusterBytes;
+  for (size_t done = 0; done < bytes && file.good(); done += DumpBlock)
+      file.write((const char*)entries + done, std::streamsize(Min(DumpBlock, bytes - done)));
 
-  double N = double(size) * 4.0;
-  return int(1000 * (1 - exp(writes * log(1.0 - 1.0/N))));
+  return file.good();
 }
+
+
+/// TranspositionTable::load() reads back a file written by save(). Files
+/// with a different entry layout or a truncated image are rejected. When
+/// the file has the same number of clusters of the current table, every
+/// entry already sits in its cluster and the image is read in place with
+/// a few bulk reads. Otherwise each entry of the file is rehashed in the
+/// current table with store(), so a dump can be loaded in a smaller or in
+/// a bigger table; in this case all loaded entries get the saved generation.
+/// Entries that do not store the full key can only be rehashed in a table
+/// with less clusters, where the cluster index supplies the missing bits.
+
+template<class Entry>
+bool TranspositionTable<Entry>::load(const std::string& fileName) {
+
+  if (!entries)
+      return false;
+
+  std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+  if (!file.is_open())
+      return false;
+
+  DumpHeader h;
+  file.read((char*)&h, sizeof(DumpHeader));
+
+  if (   !file.good()
+      || memcmp(h.magic, DumpMagic, sizeof(DumpMagic))
+      || h.version != DumpVersion
+      || h.entrySize != sizeof(Entry)
+      || !h.clusters
+      || (h.clusters & (h.clusters - 1))
+      || (!Entry::FullKey && h.clusters < size))
+      return false;
+
+  file.seekg(0, std::ios::end);
+  if (uint64_t(file.tellg()) != sizeof(DumpHeader) + h.clusters * ClusterBytes)
+      return false;
+
+  file.seekg(sizeof(DumpHeader), std::ios::beg);
+  clear();
+  generation = uint8_t(h.generation);
+
+  if (h.clusters == size)
+  {
+      size_t bytes = size * ClusterBytes;
+      for (size_t done = 0; done < bytes && file.good(); done += DumpBlock)
+          file.read((char*)entries + done, std::streamsize(Min(DumpBlock, bytes - done)));
+  }
+  else
+  {
+      const size_t BlockClusters = DumpBlock / ClusterBytes;
+      char* buf = new char[DumpBlock];
+      uint64_t cluster = 0;
+
+      while (cluster < h.clusters && file.good())
+      {
+          size_t n = size_t(Min(uint64_t(BlockClusters), h.clusters - cluster));
+          file.read(buf, std::streamsize(n * ClusterBytes));
+
+          for (size_t i = 0; i < n; i++, cluster++)
+          {
+              const Entry* e = (const Entry*)(buf + i * ClusterBytes);
+
+              for (int j = 0; j < Entry::ClusterSize; j++, e++)
+                  if (!e->empty())
+                  {
+                      Key k = e->key(size_t(cluster));
+                      TTEntry tte(k, e->raw());
+                      store(k, tte.value(), tte.type(), tte.depth(), tte.move(), 0);
+                  }
+          }
+      }
+      delete [] buf;
+  }
+
+  if (!file.good())
+  {
+      clear();
+      return false;
+  }
+  return true;
+}
+
+
+/// page_policy() converts the value of the "Large Pages" UCI option in the
+/// corresponding PagePolicy.
+
+PagePolicy page_policy(const std::string& optionValue) {
+
+  return  optionValue == "Off"         ? PAGES_NORMAL
+        : optionValue == "Transparent" ? PAGES_TRANSPARENT
+        : optionValue == "2MB"         ? PAGES_HUGE_2MB
+        : optionValue == "1GB"         ? PAGES_HUGE_1GB : PAGES_AUTO;
+}
+
+
+/// TranspositionTable::full() returns an approximation of the permill of
+/// the transposition table entries written during the current search. It
+/// is used to display the "info hashfull ..." information in UCI. Instead
+/// of counting the writes, that would need a counter shared by all the
+/// threads in store(), we look at the first clusters of the table: keys
+/// are random, so they are filled at the same rate of the whole table.
+
+template<class Entry>
+int TranspositionTable<Entry>::full() const {
+
+  const int SampleClusters = 1000 / Entry::ClusterSize;
+  int cnt = 0;
+
+  for (int i = 0; i < SampleClusters; i++)
+  {
+      const Entry* e = (const Entry*)((const char*)entries + i * ClusterBytes);
+
+      for (int j = 0; j < Entry::ClusterSize; j++, e++)
+          if (!e->empty() && TTEntry(0, e->raw()).generation() == generation)
+              cnt++;
+  }
+  return cnt * 1000 / (SampleClusters * Entry::ClusterSize);
+}
+
+
+/// TranspositionTable::layout() returns a description of the clusters, to
+/// compare runs of the two entry formats at equal memory.
+
+template<class Entry>
+const char* TranspositionTable<Entry>::layout() const {
+
+  return Entry::FullKey ? "4 x 16 bytes entries, 64 bit keys"
+                        : "6 x 10 bytes entries, 16 bit keys";
+}
+
+
+/// TranspositionTable::print_stats() writes the statistics of the current
+/// search, or since program start if 'total' is true, one item per line,
+/// each line starting with 'prefix'. Nothing is written unless the program
+/// has been compiled with -DTT_STATS.
+
+template<class Entry>
+void TranspositionTable<Entry>::print_stats(std::ostream& os, const std::string& prefix, bool total) const {
+
+#if defined(TT_STATS)
+  TTStats s = total_stats();
+
+  if (!total)
+      s.add(searchStart, -1);
+
+  s.print(os, prefix);
+#endif
+}
+
+
+#if defined(TT_STATS)
+
+/// TranspositionTable::total_stats() returns the sum of the counters of
+/// all the threads since program start.
+
+template<class Entry>
+TTStats TranspositionTable<Entry>::total_stats() const {
+
+  TTStats s;
+  s.clear();
+
+  for (int i = 0; i < THREAD_MAX; i++)
+      s.add(threadStats[i].stats, 1);
+
+  return s;
+}
+
+#endif
+
+
+/// TTStats::clear() resets all the counters
+
+void TTStats::clear() {
+
+  memset(this, 0, sizeof(TTStats));
+}
+
+
+/// TTStats::add() adds (sign = 1) or subtracts (sign = -1) the counters of
+/// another TTStats object. Used to compute the statistics of a search.
+
+void TTStats::add(const TTStats& s, int sign) {
+
+  const uint64_t* src = (const uint64_t*)&s;
+  uint64_t* dst = (uint64_t*)this;
+
+  for (size_t i = 0; i < sizeof(TTStats) / sizeof(uint64_t); i++)
+      dst[i] += sign * src[i];
+}
+
+
+/// TTStats::evict() records the replacement of an entry of another position
+
+void TTStats::evict(Depth incoming, const TTEntry& evicted, int generation) {
+
+  int d1 = Max(0, Min(int(incoming) / OnePly, Depths - 1));
+  int d2 = Max(0, Min(int(evicted.depth()) / OnePly, Depths - 1));
+  int age = Min(uint8_t(generation - evicted.generation()), Ages - 1);
+
+  replaceWrites++;
+  incomingDepth[d1]++;
+  evictedDepth[d2]++;
+  evictedAge[age]++;
+}
+
+
+/// TTStats::print() writes the statistics in a human readable form, one
+/// item per line, each line starting with 'prefix'.
+
+void TTStats::print(std::ostream& os, const std::string& prefix) const {
+
+  uint64_t writes = emptyWrites + sameKeyWrites + replaceWrites;
+  double p = probes ? 100.0 / probes : 0;
+  double w = writes ? 100.0 / writes : 0;
+  double r = replaceWrites ? 100.0 / replaceWrites : 0;
+
+  os.setf(std::ios::fixed);
+  os.precision(1);
+
+  os << prefix << "TT probes " << probes
+     << " hits " << hits * p << "%"
+     << " collisions " << collisions * p << "%" << std::endl;
+
+  os << prefix << "TT writes " << writes
+     << " empty " << emptyWrites * w << "%"
+     << " same key " << sameKeyWrites * w << "%"
+     << " replace " << replaceWrites * w << "%" << std::endl;
+
+  os << prefix << "TT replace by depth, incoming/evicted %:";
+  for (int i = 0; i < Depths; i++)
+      if (incomingDepth[i] || evictedDepth[i])
+          os << " " << i << (i == Depths - 1 ? "+" : "") << ":"
+             << incomingDepth[i] * r << "/" << evictedDepth[i] * r;
+  os << std::endl;
+
+  os << prefix << "TT evicted by age %:";
+  for (int i = 0; i < Ages; i++)
+      os << " " << i << (i == Ages - 1 ? "+" : "") << ":" << evictedAge[i] * r;
+  os << std::endl;
+
+  os.unsetf(std::ios::fixed);
+  os.precision(6);
+}
+
+
+// Explicit template instantiations, so that both layouts are always
+// compiled, whatever is the one used by TT.
+template class TranspositionTable<TTEntry>;
+template class TranspositionTable<TTCompactEntry>;
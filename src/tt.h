@@ -25,7 +25,12 @@
 //// Includes
 ////
 
+#include <cstddef>
+#include <iostream>
+#include <string>
+
 #include "depth.h"
+#include "misc.h"
 #include "position.h"
 #include "value.h"
 
@@ -38,69 +43,266 @@
 ///
 /// A TTEntry needs 128 bits to be stored
 ///
-/// bit    0-63: key
-/// bit   64-95: data
-/// bit  96-111: value
-/// bit 112-127: depth
+/// bit    0-63: key XOR data
+/// bit  64-127: data
 ///
-/// the 32 bits of the data field are so defined
+/// the 64 bits of the data field are so defined
 ///
 /// bit  0-16: move
 /// bit 17-19: not used
 /// bit 20-22: value type
 /// bit 23-31: generation
+/// bit 32-47: value
+/// bit 48-63: depth
+///
+/// Entries are written and read by all the threads without any locking. To
+/// detect an entry torn by two threads writing at the same time we store the
+/// key XOR-ed with the data, so that a key stitched together with the data
+/// of another position does not match any more (Hyatt's lockless hashing).
+/// For this to work an entry must always be copied out of the table before
+/// to be used, see TranspositionTable::retrieve().
+///
+/// TTEntry is also the type handed to the search by retrieve() whatever is
+/// the layout of the table, see TTCompactEntry.
 
 class TTEntry {
 
 public:
+  static const int ClusterSize = 4;
+  static const bool FullKey = true;
+
   TTEntry() {}
-  TTEntry(Key k, Value v, ValueType t, Depth d, Move m, int generation)
-        : key_ (k), data((m & 0x1FFFF) | (t << 20) | (generation << 23)),
-          value_(int16_t(v)), depth_(int16_t(d)) {}
+  TTEntry(Key k, uint64_t d) { save(k, d); }
+  TTEntry(Key k, Value v, ValueType t, Depth d, Move m, int generation) {
+
+      save(k, pack(v, t, d, m, generation));
+  }
 
-  Key key() const { return key_; }
-  Depth depth() const { return Depth(depth_); }
+  static uint64_t pack(Value v, ValueType t, Depth d, Move m, int generation) {
+
+      return  uint64_t(m & 0x1FFFF) | (uint64_t(t) << 20) | (uint64_t(generation) << 23)
+            | (uint64_t(uint16_t(v)) << 32) | (uint64_t(uint16_t(d)) << 48);
+  }
+
+  Key key() const { return key_ ^ data; }
+  Key key(size_t) const { return key(); }
+  Depth depth() const { return Depth(int16_t(data >> 48)); }
   Move move() const { return Move(data & 0x1FFFF); }
-  Value value() const { return Value(value_); }
+  Value value() const { return Value(int16_t(data >> 32)); }
   ValueType type() const { return ValueType((data >> 20) & 7); }
-  int generation() const { return (data >> 23); }
+  int generation() const { return int((data >> 23) & 0x1FF); }
+
+  bool empty() const { return !key(); }
+  bool matches(Key k) const { return key() == k; }
+  uint64_t raw() const { return data; }
+  void save(Key k, uint64_t d) { data = d; key_ = k ^ d; }
 
 private:
   Key key_;
-  uint32_t data;
-  int16_t value_;
-  int16_t depth_;
+  uint64_t data;
+};
+
+
+/// The TTCompactEntry class is the slot of a table built with -DTT_COMPACT.
+/// It takes 80 bits, so that 6 of them fit in a 64 bytes cluster instead of
+/// 4 TTEntry, at the price of keeping only 16 bits of the key:
+///
+/// bit   0-15: upper 16 bits of the key XOR the folded data
+/// bit  16-79: data, same layout of TTEntry
+///
+/// The lower bits of the key are already implied by the cluster index. With
+/// a 16 bit check false hits are much more frequent, but the search verifies
+/// that the TT move is legal before to play it anyway.
+
+class TTCompactEntry {
+
+public:
+  static const int ClusterSize = 6;
+  static const bool FullKey = false;
+
+  // Returns the best key we can rebuild knowing the index of the cluster
+  Key key(size_t cluster) const { return (Key(check()) << 48) | Key(cluster); }
+
+  bool empty() const { return !(w[0] | w[1] | w[2] | w[3] | w[4]); }
+  bool matches(Key k) const { return check() == uint16_t(k >> 48); }
+
+  uint64_t raw() const {
+
+      return  uint64_t(w[1]) | (uint64_t(w[2]) << 16)
+            | (uint64_t(w[3]) << 32) | (uint64_t(w[4]) << 48);
+  }
+
+  void save(Key k, uint64_t d) {
+
+      w[0] = uint16_t(k >> 48) ^ fold(d);
+      w[1] = uint16_t(d);
+      w[2] = uint16_t(d >> 16);
+      w[3] = uint16_t(d >> 32);
+      w[4] = uint16_t(d >> 48);
+  }
+
+private:
+  static uint16_t fold(uint64_t d) { return uint16_t(d ^ (d >> 16) ^ (d >> 32) ^ (d >> 48)); }
+  uint16_t check() const { return w[0] ^ fold(raw()); }
+
+  uint16_t w[5];
+};
+
+
+/// PagePolicy selects which kind of virtual memory pages should back the
+/// transposition table. With a big table almost every probe is a TLB miss
+/// when using normal 4KB pages, so we try to get huge pages instead. Each
+/// policy falls back to the next weaker one when the requested pages are
+/// not available: 1GB -> 2MB -> transparent huge pages -> normal pages.
+
+enum PagePolicy {
+  PAGES_AUTO,        // 2MB huge pages if reserved, else transparent ones
+  PAGES_NORMAL,      // Plain 4KB pages
+  PAGES_TRANSPARENT, // Normal mapping with madvise(MADV_HUGEPAGE)
+  PAGES_HUGE_2MB,    // mmap() with MAP_HUGETLB, 2MB pages
+  PAGES_HUGE_1GB     // mmap() with MAP_HUGETLB, 1GB pages
 };
 
+
+/// TTStats collects statistics on the use of the transposition table, to
+/// tune the Hash size and the replacement scheme. It is compiled in only
+/// with -DTT_STATS, otherwise the TT_STATS_DO() macro throws away the code
+/// updating it, and the default build has no overhead. Each thread counts
+/// in its own copy, away from the table data the other threads read, and
+/// print_stats() sums them.
+///
+/// A probe is a "collision" when it misses on a cluster full of other
+/// positions. Eviction histograms are by depth in plies, and by age, that
+/// is the number of searches since the evicted entry has been written.
+
+#if defined(TT_STATS)
+#  define TT_STATS_DO(x) x
+#else
+#  define TT_STATS_DO(x)
+#endif
+
+struct TTStats {
+
+  static const int Depths = 32;
+  static const int Ages = 8;
+
+  void clear();
+  void add(const TTStats& s, int sign);
+  void evict(Depth incoming, const TTEntry& evicted, int generation);
+  void print(std::ostream& os, const std::string& prefix) const;
+
+  uint64_t probes, hits, collisions;
+  uint64_t emptyWrites, sameKeyWrites, replaceWrites;
+  uint64_t incomingDepth[Depths], evictedDepth[Depths];
+  uint64_t evictedAge[Ages];
+};
+
+
+/// TTSharedHeader is the header of a table living in a POSIX shared memory
+/// segment, see tt.cpp.
+
+struct TTSharedHeader;
+
+
 /// The transposition table class.  This is basically just a huge array
-/// containing TTEntry objects, and a few methods for writing new entries
-/// and reading new ones.
+/// of 64 bytes clusters, each one holding Entry::ClusterSize entries, and a
+/// few methods for writing new entries and reading new ones. The Entry type
+/// sets the layout: TTEntry (4 x 16 bytes) or TTCompactEntry (6 x 10 bytes).
 
+const int ClusterBytes = 64;
+
+template<class Entry>
 class TranspositionTable {
 
 public:
   TranspositionTable();
   ~TranspositionTable();
-  void set_size(unsigned mbSize);
+  void set_size(unsigned mbSize, PagePolicy policy = PAGES_AUTO);
+  void reset_shared();
+  bool shared_with_others() const;
+  const char* backing() const;
+  const char* layout() const;
+  void print_stats(std::ostream& os, const std::string& prefix, bool total) const;
   void clear();
-  void store(const Key posKey, Value v, ValueType type, Depth d, Move m);
-  TTEntry* retrieve(const Key posKey) const;
+  void store(const Key posKey, Value v, ValueType type, Depth d, Move m, int threadID);
+  const TTEntry* retrieve(const Key posKey, TTEntry* tte, int threadID) const;
   void new_search();
   void insert_pv(const Position& pos, Move pv[]);
   int full() const;
+  void prefetch(const Key posKey) const;
+  bool save(const std::string& fileName) const;
+  bool load(const std::string& fileName);
 
 private:
-  inline TTEntry* first_entry(const Key posKey) const;
-
-  // Be sure 'writes' is at least one cacheline away
-  // from read only variables.
-  unsigned char pad_before[64 - sizeof(unsigned)];
-  unsigned writes; // heavy SMP read/write access here
-  unsigned char pad_after[64];
+  Entry* first_entry(const Key posKey) const;
+  void free_entries();
 
-  unsigned size;
-  TTEntry* entries;
+  size_t size;
+  Entry* entries;
   uint8_t generation;
+  PagePolicy requested, obtained;
+  bool interleaved;
+  TTSharedHeader* shared;
+  std::string sharedName;
+
+#if defined(TT_STATS)
+  struct ThreadStats {
+    TTStats stats;         // Since program start
+    unsigned char pad[64]; // keep the threads off each other's cache lines
+  };
+
+  TTStats total_stats() const;
+
+  ThreadStats* threadStats; // One per thread, indexed by thread id
+  TTStats searchStart;      // Sum at the start of the current search
+#endif
 };
 
+
+////
+//// Global variables
+////
+
+#if defined(TT_COMPACT)
+typedef TTCompactEntry TTSlot;
+#else
+typedef TTEntry TTSlot;
+#endif
+
+extern TranspositionTable<TTSlot> TT;
+
+
+////
+//// Prototypes
+////
+
+extern PagePolicy page_policy(const std::string& optionValue);
+
+
+////
+//// Inline functions
+////
+
+/// TranspositionTable::first_entry returns a pointer to the first
+/// entry of a cluster given a position.
+
+template<class Entry>
+inline Entry* TranspositionTable<Entry>::first_entry(const Key posKey) const {
+
+  return (Entry*)((char*)entries + (size_t(posKey) & (size - 1)) * ClusterBytes);
+}
+
+
+/// TranspositionTable::prefetch() preloads the cluster of the given position
+/// in cache. Called by do_move() as soon as the key of the new position is
+/// known, so that the memory access overlaps with the rest of the move
+/// making and the probe in search finds the cluster already in cache.
+
+template<class Entry>
+inline void TranspositionTable<Entry>::prefetch(const Key posKey) const {
+
+  ::prefetch((const char*)first_entry(posKey));
+}
+
+
 #endif // !defined(TT_H_INCLUDED)
@@ -29,12 +29,14 @@
 
 #include "book.h"
 #include "evaluate.h"
+#include "input.h"
 #include "misc.h"
 #include "move.h"
 #include "movegen.h"
 #include "position.h"
 #include "san.h"
 #include "search.h"
+#include "tt.h"
 #include "uci.h"
 #include "ucioption.h"
 
@@ -61,6 +63,7 @@ namespace {
   void set_option(UCIInputParser& uip);
   void set_position(UCIInputParser& uip);
   bool go(UCIInputParser& uip);
+  void save_load_hash(UCIInputParser& uip, bool save);
 }
 
 
@@ -71,20 +74,20 @@ namespace {
 /// uci_main_loop() is the only global function in this file. It is
 /// called immediately after the program has finished initializing.
 /// The program remains in this loop until it receives the "quit" UCI
-/// command. It waits for a command from the user, and passes this
-/// command to handle_command and also intercepts EOF from stdin,
-/// by translating EOF to the "quit" command. This ensures that Stockfish
-/// exits gracefully if the GUI dies unexpectedly.
+/// command. It waits for a command from the input thread, and passes this
+/// command to handle_command. The input thread translates EOF from stdin
+/// to the "quit" command. This ensures that Stockfish exits gracefully if
+/// the GUI dies unexpectedly.
 
 void uci_main_loop() {
 
   RootPosition.from_fen(StartPosition);
+  start_input_thread();
   string command;
 
   do {
-      // Wait for a command from stdin
-      if (!getline(cin, command))
-          command = "quit";
+      // Wait for a command from the input thread
+      command = read_input();
 
   } while (handle_command(command));
 }
@@ -133,6 +136,8 @@ namespace {
         set_position(uip);
     else if (token == "setoption")
         set_option(uip);
+    else if (token == "savehash" || token == "loadhash")
+        save_load_hash(uip, token == "savehash");
 
     // The remaining commands are for debugging purposes only.
     // Perhaps they should be removed later in order to reduce the
@@ -242,7 +247,10 @@ namespace {
         }
         if (token == "value")
         {
-            getline(uip, token); // reads until end of line
+            // Reads until end of line. Nothing after "value" means an
+            // empty string, like for "Shared Hash" when not sharing.
+            token.clear();
+            getline(uip >> ws, token);
             set_option_value(name, token);
         } else
             push_button(name);
@@ -315,4 +323,34 @@ namespace {
                  time, inc, movesToGo, depth, nodes, moveTime, searchMoves);
   }
 
+
+  // save_load_hash() is called when Stockfish receives the "savehash" or
+  // "loadhash" command, followed by a file name. Before loading, the table
+  // is sized according to the current options, as a search would do, and a
+  // pending "Clear Hash" is dropped, otherwise the next search would wipe
+  // out what we have just loaded.
+
+  void save_load_hash(UCIInputParser& uip, bool save) {
+
+    string fileName;
+
+    uip >> fileName;
+    if (fileName.empty())
+    {
+        cout << "info string Missing file name" << endl;
+        return;
+    }
+
+    if (!save)
+    {
+        TT.set_size(get_option_value_int("Hash"), page_policy(get_option_value_string("Large Pages")));
+        button_was_pressed("Clear Hash");
+    }
+
+    bool ok = save ? TT.save(fileName) : TT.load(fileName);
+
+    cout << "info string " << (save ? "Saving hash to " : "Loading hash from ")
+         << fileName << (ok ? " done" : " failed") << endl;
+  }
+
 }
@@ -124,10 +124,32 @@ namespace {
     o["LSN Value Margin"] = Option(200, 100, 600);
     o["Randomness"] = Option(0, 0, 10);
     o["Minimum Split Depth"] = Option(4, 4, 7);
-    o["Maximum Number of Threads per Split Point"] = Option(5, 4, 8);
-    o["Threads"] = Option(1, 1, 8);
-    o["Hash"] = Option(32, 4, 4096);
+    o["Maximum Number of Threads per Split Point"] = Option(5, 4, SPLIT_MAX);
+    o["Threads"] = Option(1, 1, THREAD_MAX);
+    o["Late Join"] = Option(false);
+    o["SMP Mode"] = Option("YBWC", COMBO);
+
+       o["SMP Mode"].comboValues.push_back("YBWC");
+       o["SMP Mode"].comboValues.push_back("Lazy SMP");
+
+    o["Root Split"] = Option(false);
+    o["Thread History"] = Option(false);
+    o["Countermove History"] = Option(false);
+    o["NUMA"] = Option(false);
+    o["Thread Affinity"] = Option(false);
+    o["Hash"] = Option(32, 4, 262144);
     o["Clear Hash"] = Option(false, BUTTON);
+    o["Shared Hash"] = Option("");
+    o["Reset Shared Hash"] = Option(false, BUTTON);
+    o["Large Pages"] = Option("Auto", COMBO);
+
+       o["Large Pages"].comboValues.push_back("Auto");
+       o["Large Pages"].comboValues.push_back("Off");
+       o["Large Pages"].comboValues.push_back("Transparent");
+       o["Large Pages"].comboValues.push_back("2MB");
+       o["Large Pages"].comboValues.push_back("1GB");
+
+    o["Deterministic"] = Option(false);
     o["Ponder"] = Option(true);
     o["OwnBook"] = Option(true);
     o["MultiPV"] = Option(1, 1, 500);
@@ -268,11 +290,15 @@ int get_option_value_int(const string& optionName) {
 
 
 /// get_option_value_string() returns the current value of a UCI parameter as
-/// a string. It is used with parameters of type "combo" and "string".
+/// a string. It is used with parameters of type "combo" and "string". The
+/// value is returned whole, it may contain spaces.
 
 string get_option_value_string(const string& optionName) {
 
-   return get_option_value<string>(optionName);
+   if (options.find(optionName) == options.end())
+       return string();
+
+   return options[optionName].currentValue;
 }
 
 